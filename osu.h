@@ -9,17 +9,25 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <memory.h>
+#include <stdarg.h>
 
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <chrono>
 #include <thread>
 #include <map>
 
 #include "osu_micros.h"
+#include "osu_closure.h"
+#include "osu_thread.h"
 #include "osu_timer.h"
 #include "osu_dispatch_queue.h"
+#include "osu_dispatch_future.h"
 #include "osu_string.h"
 #include "osu_cmd_parser.h"
 
@@ -0,0 +1,162 @@
+#ifndef PROJECT_OSU_CLOSURE_H
+#define PROJECT_OSU_CLOSURE_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace osu {
+
+    // Move-only replacement for std::function<void()>.
+    // Callables up to inline_size bytes are stored in place, so posting a typical lambda costs no
+    // heap allocation, and captures may be move-only (std::unique_ptr, std::promise ...).
+    class Closure {
+    public:
+        static constexpr size_t inline_size = 56;
+
+        Closure() noexcept : ops_(nullptr) {}
+
+        Closure(std::nullptr_t) noexcept : ops_(nullptr) {}
+
+        template<typename F, typename Fn = typename std::decay<F>::type,
+                typename = typename std::enable_if<!std::is_same<Fn, Closure>::value>::type>
+        Closure(F &&f) : ops_(nullptr) {
+            construct<Fn>(std::forward<F>(f), std::integral_constant<bool, fits_inline<Fn>()>());
+        }
+
+        Closure(Closure &&other) noexcept : ops_(other.ops_) {
+            if (ops_ != nullptr) {
+                ops_->relocate(storage_, other.storage_);
+                other.ops_ = nullptr;
+            }
+        }
+
+        Closure &operator=(Closure &&other) noexcept {
+            if (this != &other) {
+                reset();
+                if (other.ops_ != nullptr) {
+                    other.ops_->relocate(storage_, other.storage_);
+                    ops_ = other.ops_;
+                    other.ops_ = nullptr;
+                }
+            }
+            return *this;
+        }
+
+        Closure &operator=(std::nullptr_t) noexcept {
+            reset();
+            return *this;
+        }
+
+        Closure(Closure const &) = delete;
+
+        Closure &operator=(Closure const &) = delete;
+
+        ~Closure() {
+            reset();
+        }
+
+        explicit operator bool() const noexcept {
+            return ops_ != nullptr;
+        }
+
+        void operator()() {
+            ops_->invoke(storage_);
+        }
+
+        // True when the callable lives in the inline buffer.
+        bool is_inline() const noexcept {
+            return ops_ != nullptr && ops_->is_inline;
+        }
+
+    private:
+        struct ops {
+            void (*invoke)(void *storage);
+            // Move-construct into dst and destroy the source.
+            void (*relocate)(void *dst, void *src);
+            void (*destroy)(void *storage);
+            bool is_inline;
+        };
+
+        template<typename Fn>
+        static constexpr bool fits_inline() {
+            return sizeof(Fn) <= inline_size && alignof(Fn) <= alignof(void *) &&
+                   std::is_nothrow_move_constructible<Fn>::value;
+        }
+
+        template<typename Fn>
+        struct inline_ops {
+            static void invoke(void *storage) {
+                (*static_cast<Fn *>(storage))();
+            }
+
+            static void relocate(void *dst, void *src) {
+                Fn *f = static_cast<Fn *>(src);
+                new(dst) Fn(std::move(*f));
+                f->~Fn();
+            }
+
+            static void destroy(void *storage) {
+                static_cast<Fn *>(storage)->~Fn();
+            }
+
+            static const ops table;
+        };
+
+        template<typename Fn>
+        struct heap_ops {
+            static Fn *&get(void *storage) {
+                return *static_cast<Fn **>(storage);
+            }
+
+            static void invoke(void *storage) {
+                (*get(storage))();
+            }
+
+            static void relocate(void *dst, void *src) {
+                new(dst) Fn *(get(src));
+            }
+
+            static void destroy(void *storage) {
+                delete get(storage);
+            }
+
+            static const ops table;
+        };
+
+        template<typename Fn, typename F>
+        void construct(F &&f, std::true_type) {
+            new(storage_) Fn(std::forward<F>(f));
+            ops_ = &inline_ops<Fn>::table;
+        }
+
+        template<typename Fn, typename F>
+        void construct(F &&f, std::false_type) {
+            new(storage_) Fn *(new Fn(std::forward<F>(f)));
+            ops_ = &heap_ops<Fn>::table;
+        }
+
+        void reset() noexcept {
+            if (ops_ != nullptr) {
+                ops_->destroy(storage_);
+                ops_ = nullptr;
+            }
+        }
+
+        alignas(void *) unsigned char storage_[inline_size];
+        const ops *ops_;
+    };
+
+    template<typename Fn>
+    const Closure::ops Closure::inline_ops<Fn>::table = {
+            &Closure::inline_ops<Fn>::invoke, &Closure::inline_ops<Fn>::relocate, &Closure::inline_ops<Fn>::destroy,
+            true};
+
+    template<typename Fn>
+    const Closure::ops Closure::heap_ops<Fn>::table = {
+            &Closure::heap_ops<Fn>::invoke, &Closure::heap_ops<Fn>::relocate, &Closure::heap_ops<Fn>::destroy,
+            false};
+}
+
+#endif //PROJECT_OSU_CLOSURE_H
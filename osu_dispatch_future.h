@@ -0,0 +1,316 @@
+#ifndef PROJECT_OSU_DISPATCH_FUTURE_H
+#define PROJECT_OSU_DISPATCH_FUTURE_H
+
+#include <atomic>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "osu_dispatch_queue.h"
+
+namespace osu {
+
+    // What calling a decayed F with arguments A returns.
+    template<typename F, typename... A>
+    using dispatch_result_t = decltype(std::declval<typename std::decay<F>::type &>()(std::declval<A>()...));
+
+    // Value slot of a future, nothing but the flag for void.
+    template<typename T>
+    class dispatch_future_value {
+    public:
+        ~dispatch_future_value() {
+            if (has_value_) {
+                reinterpret_cast<T *>(storage_)->~T();
+            }
+        }
+
+        template<typename... A>
+        void set(A &&... args) {
+            new(storage_) T(std::forward<A>(args)...);
+            has_value_ = true;
+        }
+
+        T &get() {
+            return *reinterpret_cast<T *>(storage_);
+        }
+
+        T take() {
+            return std::move(get());
+        }
+
+    private:
+        alignas(T) unsigned char storage_[sizeof(T)];
+        bool has_value_ = false;
+    };
+
+    template<>
+    class dispatch_future_value<void> {
+    public:
+        void set() {}
+
+        void get() {}
+
+        void take() {}
+    };
+
+    // Shared by one promise and one future. Whoever comes second of the producer publishing the result
+    // and the consumer attaching a continuation runs the continuation, so neither side ever blocks;
+    // the mutex is only touched by a thread that actually waits in get().
+    template<typename T>
+    struct dispatch_future_state {
+        enum : int {
+            empty, continued, waiting, ready
+        };
+
+        std::atomic<int> status{empty};
+        dispatch_future_value<T> value;
+        std::exception_ptr error;
+        Closure continuation;
+        std::mutex mtx;
+        std::condition_variable cond;
+
+        // After value or error was filled in.
+        void publish() {
+            int prev = status.exchange(ready, std::memory_order_acq_rel);
+            if (prev == continued) {
+                Closure next = std::move(continuation);
+                next();
+            } else if (prev == waiting) {
+                std::unique_lock<std::mutex> _(mtx);
+                cond.notify_all();
+            }
+        }
+
+        // Runs next once the result is there, right away if it already is.
+        void on_ready(Closure next) {
+            continuation = std::move(next);
+            int expected = empty;
+            if (!status.compare_exchange_strong(expected, continued, std::memory_order_acq_rel)) {
+                Closure now = std::move(continuation);
+                now();
+            }
+        }
+
+        void wait() {
+            int expected = empty;
+            if (status.compare_exchange_strong(expected, waiting, std::memory_order_acquire) || expected == waiting) {
+                std::unique_lock<std::mutex> lock(mtx);
+                cond.wait(lock, [this] { return status.load(std::memory_order_acquire) == ready; });
+            }
+        }
+    };
+
+    // Carried by the task that is to fill in state. Dropped still holding it, because a bounded queue
+    // shed the task before it ran, it breaks the future rather than leaving it pending forever.
+    template<typename T>
+    class dispatch_future_guard {
+    public:
+        explicit dispatch_future_guard(std::shared_ptr<dispatch_future_state<T> > state) : state_(std::move(state)) {}
+
+        dispatch_future_guard(dispatch_future_guard &&) = default;
+
+        ~dispatch_future_guard() {
+            if (state_) {
+                state_->error = std::make_exception_ptr(std::future_error(std::future_errc::broken_promise));
+                state_->publish();
+            }
+        }
+
+        // Once the task runs, it fills in the state itself.
+        std::shared_ptr<dispatch_future_state<T> > release() {
+            return std::move(state_);
+        }
+
+    private:
+        std::shared_ptr<dispatch_future_state<T> > state_;
+    };
+
+    // Calls f with args and stores what it returned, or what it threw, into state.
+    template<typename R>
+    struct dispatch_future_call {
+        template<typename F, typename... A>
+        static void apply(dispatch_future_state<R> &state, F &f, A &&... args) {
+            try {
+                state.value.set(f(std::forward<A>(args)...));
+            } catch (...) {
+                state.error = std::current_exception();
+            }
+            state.publish();
+        }
+    };
+
+    template<>
+    struct dispatch_future_call<void> {
+        template<typename F, typename... A>
+        static void apply(dispatch_future_state<void> &state, F &f, A &&... args) {
+            try {
+                f(std::forward<A>(args)...);
+            } catch (...) {
+                state.error = std::current_exception();
+            }
+            state.publish();
+        }
+    };
+
+    template<typename T>
+    class DispatchFuture;
+
+    template<typename T, typename F>
+    struct dispatch_future_then {
+        using type = dispatch_result_t<F, T>;
+
+        static void apply(dispatch_future_state<T> &from, dispatch_future_state<type> &to, F &f) {
+            dispatch_future_call<type>::apply(to, f, std::move(from.value.get()));
+        }
+    };
+
+    template<typename F>
+    struct dispatch_future_then<void, F> {
+        using type = dispatch_result_t<F>;
+
+        static void apply(dispatch_future_state<void> &, dispatch_future_state<type> &to, F &f) {
+            dispatch_future_call<type>::apply(to, f);
+        }
+    };
+
+    // Write side of a DispatchFuture. A promise dropped without a result breaks the future.
+    template<typename T>
+    class DispatchPromise {
+    public:
+        DispatchPromise() : state_(std::make_shared<dispatch_future_state<T> >()) {}
+
+        DispatchPromise(DispatchPromise &&) = default;
+
+        DispatchPromise &operator=(DispatchPromise &&) = default;
+
+        ~DispatchPromise() {
+            if (state_ && !published_) {
+                set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+            }
+        }
+
+        // Only once.
+        DispatchFuture<T> get_future() {
+            return DispatchFuture<T>(state_);
+        }
+
+        template<typename... A>
+        void set_value(A &&... args) {
+            state_->value.set(std::forward<A>(args)...);
+            published_ = true;
+            state_->publish();
+        }
+
+        void set_exception(std::exception_ptr error) {
+            state_->error = std::move(error);
+            published_ = true;
+            state_->publish();
+        }
+
+    private:
+        std::shared_ptr<dispatch_future_state<T> > state_;
+        bool published_ = false;
+    };
+
+    // Result of a task run on a DispatchQueue. Move-only and single use: either get() it or chain
+    // a continuation with then(), which runs on the given queue without blocking any thread.
+    template<typename T>
+    class DispatchFuture {
+    public:
+        DispatchFuture() {}
+
+        DispatchFuture(DispatchFuture &&) = default;
+
+        DispatchFuture &operator=(DispatchFuture &&) = default;
+
+        bool valid() const {
+            return state_ != nullptr;
+        }
+
+        // ready, wait, get and then on an invalid future throw future_error(no_state), as std::future does.
+        bool ready() const {
+            check_state();
+            return state_->status.load(std::memory_order_acquire) == dispatch_future_state<T>::ready;
+        }
+
+        void wait() {
+            check_state();
+            state_->wait();
+        }
+
+        // Blocks until the result is there, rethrows what the task threw. Leaves the future invalid.
+        T get() {
+            check_state();
+            auto state = std::move(state_);
+            state->wait();
+            if (state->error) {
+                std::rethrow_exception(state->error);
+            }
+            return state->value.take();
+        }
+
+        // Posts fn(result) to queue once the result is there and returns the future of its result.
+        // An exception skips fn and travels down the chain. Leaves this future invalid.
+        template<typename F>
+        DispatchFuture<typename dispatch_future_then<T, F>::type> then(DispatchQueue &queue, F &&fn) {
+            using Fn = typename std::decay<F>::type;
+            using R = typename dispatch_future_then<T, Fn>::type;
+            check_state();
+            auto next = std::make_shared<dispatch_future_state<R> >();
+            auto from = std::move(state_);
+            DispatchQueue *target = &queue;
+
+            // from owns this closure until it runs, the reference it holds back is dropped with it.
+            from->on_ready([from, next, target, fn = std::forward<F>(fn)]() mutable {
+                if (from->error) {
+                    next->error = from->error;
+                    next->publish();
+                    return;
+                }
+                target->dispatch_async([from = std::move(from), next = dispatch_future_guard<R>(std::move(next)),
+                                               fn = std::move(fn)]() mutable {
+                    auto to = next.release();
+                    dispatch_future_then<T, Fn>::apply(*from, *to, fn);
+                });
+            });
+            return DispatchFuture<R>(std::move(next));
+        }
+
+    private:
+        template<typename U> friend class DispatchPromise;
+
+        template<typename U> friend class DispatchFuture;
+
+        template<typename F>
+        friend DispatchFuture<dispatch_result_t<F> > dispatch_async(DispatchQueue &queue, F &&fn);
+
+        explicit DispatchFuture(std::shared_ptr<dispatch_future_state<T> > state) : state_(std::move(state)) {}
+
+        void check_state() const {
+            if (!state_) {
+                throw std::future_error(std::future_errc::no_state);
+            }
+        }
+
+        std::shared_ptr<dispatch_future_state<T> > state_;
+    };
+
+    // dispatch_async that hands back the result of fn, or the exception it threw. Shed by a bounded
+    // queue, fn never runs and get() throws future_error(broken_promise).
+    template<typename F>
+    DispatchFuture<dispatch_result_t<F> > dispatch_async(DispatchQueue &queue, F &&fn) {
+        using R = dispatch_result_t<F>;
+        auto state = std::make_shared<dispatch_future_state<R> >();
+        queue.dispatch_async([guard = dispatch_future_guard<R>(state), fn = std::forward<F>(fn)]() mutable {
+            auto to = guard.release();
+            dispatch_future_call<R>::apply(*to, fn);
+        });
+        return DispatchFuture<R>(std::move(state));
+    }
+}
+
+#endif //PROJECT_OSU_DISPATCH_FUTURE_H
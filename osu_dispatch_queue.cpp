@@ -3,242 +3,2482 @@
 //
 
 #include "osu_dispatch_queue.h"
+#include "osu_mpsc_queue.h"
+#include "osu_timing_wheel.h"
+#include "osu_micros.h"
+#include <algorithm>
+#include <unordered_map>
+#include <errno.h>
+#include <string.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 namespace osu {
     using time_point = std::chrono::steady_clock::time_point;
 
+    // Lets a DispatchTimer reach its queue for as long as the queue is alive.
+    struct dispatch_timer_anchor {
+        std::mutex mtx;
+        DispatchQueue *queue = nullptr;
+        // Instead of queue, for the timers of a DispatchQueueMain.
+        DispatchQueueMain *main = nullptr;
+    };
+
+    struct dispatch_timer_state {
+        enum : int {
+            // firing: a repeating timer running, back to pending once it returned.
+            pending, fired, cancelled, firing
+        };
+
+        TimingWheelNode link;
+        std::atomic<int> status;
+        time_point expiry;
+        // Non-zero for a repeating timer.
+        std::chrono::nanoseconds interval{0};
+        // Only touched by whoever moves status away from pending, and run in place while firing.
+        Closure func;
+        // Keeps the timer alive while it sits in a wheel.
+        std::shared_ptr<dispatch_timer_state> self;
+        std::weak_ptr<dispatch_timer_anchor> anchor;
+    };
+
+    struct dispatch_group_state {
+        std::atomic<size_t> count{0};
+        std::mutex mtx;
+        std::condition_variable cond;
+        // Callbacks waiting for the group to empty, with the queue each one goes to.
+        std::vector<std::pair<DispatchQueue *, Closure> > notify;
+
+        void leave();
+    };
+
     struct dispatch_que_work_entry {
-        explicit dispatch_que_work_entry(std::function<void()> func_)
-                : func(std::move(func_)), expiry(time_point()), from_timer(false) {
+        enum kind_t : uint8_t {
+            // timer_fire: a due repeating timer, whose func is run in place.
+            task, timer_add, timer_cancel, barrier, timer_fire
+        };
+
+        dispatch_que_work_entry() : kind(task) {
+        }
+
+        explicit dispatch_que_work_entry(Closure func_)
+                : func(std::move(func_)), kind(task) {
+        }
+
+        dispatch_que_work_entry(std::shared_ptr<dispatch_timer_state> timer_, kind_t kind_)
+                : timer(std::move(timer_)), kind(kind_) {
+        }
+
+        Closure func;
+        std::shared_ptr<dispatch_timer_state> timer;
+        // Left once func returned, for tasks posted through DispatchGroup::dispatch_async.
+        std::shared_ptr<dispatch_group_state> group;
+        // stats_clock() at submission while the queue measures, 0 otherwise.
+        uint64_t stamp = 0;
+        kind_t kind;
+        // Counted against the capacity of a bounded queue, which also makes it fair game for drop_oldest.
+        bool counted = false;
+    };
+
+    using dispatch_que_batch = std::deque<dispatch_que_work_entry>;
+
+    // Measurements of one worker thread, the only one recording into them.
+    struct dispatch_que_stats {
+        Histogram wait;
+        Histogram run;
+        Histogram lateness;
+    };
+
+    static uint64_t stats_clock() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Runs a task or barrier entry and releases what it holds.
+    static void run_task(dispatch_que_work_entry &work) {
+        work.func();
+        work.func = nullptr;
+        if (work.group) {
+            work.group->leave();
+            work.group.reset();
+        }
+    }
+
+    // run_task, timed into stats unless that is null.
+    static void run_task(dispatch_que_work_entry &work, dispatch_que_stats *stats) {
+        if (stats == nullptr) {
+            run_task(work);
+            return;
+        }
+
+        uint64_t start = stats_clock();
+        if (work.stamp != 0 && start > work.stamp) {
+            stats->wait.record(start - work.stamp);
+        }
+        run_task(work);
+        stats->run.record(stats_clock() - start);
+    }
+
+    // Releases a task that is never going to run, its group still gets the leave.
+    static void discard_task(dispatch_que_work_entry &work) {
+        work.func = nullptr;
+        if (work.group) {
+            work.group->leave();
+            work.group.reset();
+        }
+    }
+
+    // Completion flag a dispatch_sync caller blocks on. There is one per thread, reused by every
+    // dispatch_sync it makes, so a sync call costs no mutex/condition variable construction.
+    // On Linux the wait is a futex and the signalling side makes a syscall only if the waiter sleeps.
+    class sync_completion {
+    public:
+        static sync_completion &local() {
+            static thread_local sync_completion completion;
+            return completion;
+        }
+
+        void reset() {
+            state_.store(pending, std::memory_order_relaxed);
+        }
+
+        void signal() {
+#if defined(__linux__)
+            if (state_.exchange(done, std::memory_order_release) == sleeping) {
+                syscall(SYS_futex, &state_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+            }
+#else
+            std::unique_lock<std::mutex> _(mtx_);
+            state_.store(done, std::memory_order_release);
+            cond_.notify_one();
+#endif
+        }
+
+        void wait() {
+            // Most sync tasks are short, spin a little before going to sleep.
+            for (int i = 0; i < 64; ++i) {
+                if (state_.load(std::memory_order_acquire) == done) return;
+            }
+#if defined(__linux__)
+            uint32_t expected = pending;
+            if (state_.compare_exchange_strong(expected, sleeping, std::memory_order_acquire)) {
+                expected = sleeping;
+            }
+            while (expected != done) {
+                syscall(SYS_futex, &state_, FUTEX_WAIT_PRIVATE, sleeping, nullptr, nullptr, 0);
+                expected = state_.load(std::memory_order_acquire);
+            }
+#else
+            std::unique_lock<std::mutex> lock(mtx_);
+            cond_.wait(lock, [this] { return state_.load(std::memory_order_acquire) == done; });
+#endif
+        }
+
+    private:
+        enum : uint32_t {
+            pending, done, sleeping
+        };
+
+        std::atomic<uint32_t> state_{pending};
+#if !defined(__linux__)
+        std::mutex mtx_;
+        std::condition_variable cond_;
+#endif
+    };
+
+    // Moves up to limit of the oldest entries of a push_front/pop_back queue into batch, which must be empty.
+    static size_t take_batch(dispatch_que_batch &from, dispatch_que_batch &batch, size_t limit) {
+        if (limit >= from.size()) {
+            batch.swap(from);
+            return batch.size();
+        }
+
+        batch.insert(batch.end(), std::make_move_iterator(from.end() - limit), std::make_move_iterator(from.end()));
+        from.erase(from.end() - limit, from.end());
+        return limit;
+    }
+
+    // Runs a batch taken by take_batch, oldest first.
+    static void run_batch(dispatch_que_batch &batch, dispatch_que_stats *stats = nullptr) {
+        while (!batch.empty()) {
+            run_task(batch.back(), stats);
+            batch.pop_back();
+        }
+    }
+
+    static size_t batch_limit(std::atomic<size_t> const &max_batch) {
+        size_t limit = max_batch.load(std::memory_order_relaxed);
+        return limit == 0 ? SIZE_MAX : limit;
+    }
+
+    // Times in a row a waiting lane may be passed over for a higher one before it is served anyway.
+    static const size_t dispatch_qos_aging = 32;
+
+    // Picks the lane to serve next, -1 if all are empty: the highest non-empty one, unless a lower one
+    // has aged past dispatch_qos_aging. passed holds the ages and belongs to a single consumer.
+    template<typename NonEmpty>
+    static int pick_lane(size_t (&passed)[dispatch_qos_count], NonEmpty &&non_empty) {
+        bool waiting[dispatch_qos_count];
+        int pick = -1;
+        for (size_t i = 0; i < dispatch_qos_count; ++i) {
+            waiting[i] = non_empty(i);
+            if (!waiting[i]) {
+                passed[i] = 0;
+            } else if (pick < 0 || (passed[i] >= dispatch_qos_aging && passed[pick] < dispatch_qos_aging)) {
+                pick = (int) i;
+            }
+        }
+
+        for (size_t i = 0; i < dispatch_qos_count; ++i) {
+            if (waiting[i]) {
+                passed[i] = (int) i == pick ? 0 : passed[i] + 1;
+            }
+        }
+        return pick;
+    }
+
+    // Delayed work of one queue, kept in a timing wheel with microsecond ticks. Only the worker firing
+    // it touches it, so filing a timer is O(1) and needs no lock of its own.
+    class dispatch_timers {
+    public:
+        dispatch_timers() : wheel_(now_tick(std::chrono::steady_clock::now())) {
+        }
+
+        ~dispatch_timers() {
+            wheel_.clear([](TimingWheelNode *link) {
+                OSU_CONTAINER_OF(link, dispatch_timer_state, link)->self.reset();
+            });
+        }
+
+        bool empty() const {
+            return wheel_.empty();
+        }
+
+        void add(std::shared_ptr<dispatch_timer_state> timer) {
+            if (timer->status.load() != dispatch_timer_state::pending) {
+                return;
+            }
+
+            timer->link.expiry = expiry_tick(timer->expiry);
+            wheel_.insert(&timer->link);
+            timer->self = std::move(timer);
+        }
+
+        // O(1), the closure was already released by DispatchTimer::cancel.
+        void cancel(dispatch_timer_state *timer) {
+            if (timer->link.linked()) {
+                wheel_.remove(&timer->link);
+                timer->self.reset();
+            }
+        }
+
+        // Appends every timer due by now to the front of due, so due.back() is the earliest.
+        // With stats, records how late each one is and stamps it for the wait histogram.
+        void expire(time_point now, dispatch_que_batch &due, dispatch_que_stats *stats) {
+            uint64_t stamp = stats != nullptr ? stats_clock() : 0;
+            wheel_.advance(now_tick(now), [&](TimingWheelNode *link) {
+                auto *timer = OSU_CONTAINER_OF(link, dispatch_timer_state, link);
+                bool repeating = timer->interval.count() > 0;
+                int expected = dispatch_timer_state::pending;
+                if (timer->status.compare_exchange_strong(expected, repeating ? dispatch_timer_state::firing
+                                                                              : dispatch_timer_state::fired)) {
+                    if (repeating) {
+                        due.push_front(dispatch_que_work_entry(timer->self, dispatch_que_work_entry::timer_fire));
+                    } else {
+                        due.push_front(dispatch_que_work_entry(std::move(timer->func)));
+                    }
+                    if (stats != nullptr) {
+                        due.front().stamp = stamp;
+                        if (now > timer->expiry) {
+                            stats->lateness.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    now - timer->expiry).count());
+                        }
+                    }
+                }
+                timer->self.reset();
+            });
+        }
+
+        // Files an add or cancel entry.
+        void apply(dispatch_que_work_entry &work) {
+            if (work.kind == dispatch_que_work_entry::timer_add) {
+                add(std::move(work.timer));
+            } else {
+                cancel(work.timer.get());
+                work.timer.reset();
+            }
+        }
+
+        // When the worker has to look at the wheel again, time_point::max() if it is empty.
+        time_point next_wakeup() const {
+            uint64_t tick = wheel_.next_event();
+            if (tick == TimingWheel::never) {
+                return time_point::max();
+            }
+            return time_point(std::chrono::microseconds(tick));
+        }
+
+    private:
+        static uint64_t now_tick(time_point t) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+        }
+
+        // Rounded up so a timer never fires before its expiry.
+        static uint64_t expiry_tick(time_point t) {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+            return (uint64_t) (ns + 999) / 1000;
+        }
+
+        TimingWheel wheel_;
+    };
+
+    // Common part of serial and concurrent queues.
+    struct DispatchQueue::impl {
+        impl();
+
+        virtual ~impl() {}
+
+        virtual void dispatch_async(dispatch_que_work_entry work, DispatchQos qos) = 0;
+
+        // dispatch_async held to the capacity. False, with the task released, when it was rejected.
+        virtual bool dispatch_bounded(dispatch_que_work_entry work, DispatchQos qos, bool try_only) = 0;
+
+        // Hands an add or cancel entry to whoever owns the queue's timing wheel.
+        virtual void dispatch_timer(dispatch_que_work_entry work) = 0;
+
+        // Only a concurrent queue has anything to hold back.
+        virtual void dispatch_barrier(dispatch_que_work_entry work) {
+            dispatch_async(std::move(work), DispatchQos::normal);
+        }
+
+        // Lanes are FIFO only within themselves, so the flush goes through each of them.
+        virtual void dispatch_flush() {
+            for (auto qos : {DispatchQos::interactive, DispatchQos::normal, DispatchQos::background}) {
+                dispatch_sync([] {}, qos);
+            }
+        }
+
+        // Drain pending work and stop all threads, called once from ~DispatchQueue.
+        virtual void shutdown() = 0;
+
+        virtual size_t queue_depth(DispatchQos qos) const = 0;
+
+        // Tasks the queue can run at the same time.
+        virtual size_t concurrency() const {
+            return 1;
+        }
+
+        // The task and its completion travel as one entry; from the queue's own thread it runs inline.
+        void dispatch_sync(Closure func, DispatchQos qos);
+
+        void set_max_batch(size_t max_batch);
+
+        virtual void stats(DispatchQueueStats &out) const = 0;
+
+        // Stops DispatchTimer::cancel from reaching the queue, first thing in shutdown.
+        void detach_anchor();
+
+        // Submission time for the wait histogram, only read from the clock while measuring.
+        void stamp(dispatch_que_work_entry &work) const {
+            if (stats_enabled.load(std::memory_order_relaxed)) {
+                work.stamp = stats_clock();
+            }
+        }
+
+        bool reject(dispatch_que_work_entry &work) {
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            discard_task(work);
+            return false;
+        }
+
+        // Where a worker records to, null while not measuring.
+        dispatch_que_stats *measuring(dispatch_que_stats &stats) const {
+            return stats_enabled.load(std::memory_order_relaxed) ? &stats : nullptr;
+        }
+
+        std::atomic<bool> quit;
+
+        std::atomic<bool> stats_enabled;
+
+        std::shared_ptr<dispatch_timer_anchor> anchor;
+
+        // Most tasks a worker takes per visit to the queue, 0 means everything pending.
+        std::atomic<size_t> max_batch;
+
+        // 0 while unbounded, then dispatch_async goes through dispatch_bounded.
+        std::atomic<size_t> capacity;
+        std::atomic<DispatchOverflow> overflow_policy;
+        std::atomic<uint64_t> rejected;
+        std::atomic<uint64_t> dropped;
+
+        // The queue whose worker is running on this thread, if any.
+        static thread_local impl *current_queue;
+    };
+
+    DispatchQueue::impl::impl()
+            : quit(false), stats_enabled(false), anchor(std::make_shared<dispatch_timer_anchor>()), max_batch(0),
+              capacity(0), overflow_policy(DispatchOverflow::block), rejected(0), dropped(0) {
+        anchor->queue = nullptr;
+    }
+
+    void DispatchQueue::impl::detach_anchor() {
+        std::unique_lock<std::mutex> _(anchor->mtx);
+        anchor->queue = nullptr;
+    }
+
+    thread_local DispatchQueue::impl *DispatchQueue::impl::current_queue = nullptr;
+
+    void DispatchQueue::impl::dispatch_sync(Closure func, DispatchQos qos) {
+        if (current_queue == this) {
+            func();
+            return;
+        }
+
+        sync_completion &completion = sync_completion::local();
+        completion.reset();
+        dispatch_async(dispatch_que_work_entry([&func, &completion] {
+            func();
+            completion.signal();
+        }), qos);
+        completion.wait();
+    }
+
+    void DispatchQueue::impl::set_max_batch(size_t n) {
+        max_batch = n;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Serial queue
+
+    struct DispatchQueue::serial_impl : DispatchQueue::impl {
+        // Submissions of one DispatchQos go to the lock-free ring. Only when it is full do producers
+        // fall back to overflow under work_queue_mtx, and they keep doing so until the worker took
+        // it over, which keeps every producer's tasks in FIFO order.
+        // Cells per lane ring, an entry being about 120 bytes. Small, so a queue costs little while idle;
+        // the overflow takes what a burst doesn't fit.
+        static const size_t ring_capacity = 128;
+
+        struct lane {
+            MpscQueue<dispatch_que_work_entry> ring{ring_capacity};
+            std::deque<dispatch_que_work_entry> overflow;
+            std::atomic<size_t> overflow_size{0};
+            // Worker only: overflow taken over in one go, it is older than anything in the ring.
+            dispatch_que_batch stash;
+            std::atomic<size_t> stashed{0};
+        };
+
+        explicit serial_impl(ThreadOptions const &thread);
+
+        void dispatch_async(dispatch_que_work_entry work, DispatchQos qos) override;
+
+        bool dispatch_bounded(dispatch_que_work_entry work, DispatchQos qos, bool try_only) override;
+
+        void dispatch_timer(dispatch_que_work_entry work) override;
+
+        void shutdown() override;
+
+        size_t queue_depth(DispatchQos qos) const override;
+
+        void stats(DispatchQueueStats &out) const override;
+
+        size_t run_pending();
+
+        void run_entry(dispatch_que_work_entry &work, dispatch_que_stats *stats);
+
+        bool lane_empty(lane const &l) const;
+
+        bool pop(lane &l, dispatch_que_work_entry &work);
+
+        bool evict_oldest(dispatch_que_work_entry &evicted);
+
+        bool has_work() const;
+
+        void wake_worker();
+
+        static void dispatch_thread_proc(serial_impl *self, ThreadOptions thread);
+
+        lane lanes[dispatch_qos_count];
+        // Worker only, see pick_lane.
+        size_t passed[dispatch_qos_count];
+
+        std::mutex work_queue_mtx;
+        std::condition_variable work_queue_cond;
+
+        // Under work_queue_mtx. A bounded queue keeps its counted entries in overflow, where producers
+        // can see and evict them, and the worker takes them one at a time.
+        size_t bounded_size = 0;
+        int space_waiters = 0;
+        std::condition_variable space_cond;
+
+        // Worker thread only. dispatch_after entries travel through the interactive lane and are
+        // filed into timers on arrival; due ones wait in due and run before anything still queued.
+        dispatch_timers timers;
+        dispatch_que_batch due;
+        dispatch_que_batch batch;
+
+        // Written by the worker only. The depth high-water marks are sampled whenever it comes for more work.
+        dispatch_que_stats measured;
+        std::atomic<size_t> depth_high[dispatch_qos_count];
+
+        std::thread work_queue_thread;
+
+        std::atomic<bool> work_queue_thread_started;
+        std::atomic<bool> parked;
+
+        using work_queue_lock = std::unique_lock<decltype(work_queue_mtx)>;
+    };
+
+    // Runs one batch of at most max_batch tasks and returns how many ran. Each source is visited once,
+    // so the locked queues are swapped out under a single lock instead of once per task.
+    size_t DispatchQueue::serial_impl::run_pending() {
+        size_t limit = batch_limit(max_batch);
+        size_t n = 0;
+        dispatch_que_stats *stats = measuring(measured);
+
+        if (!timers.empty()) {
+            timers.expire(std::chrono::steady_clock::now(), due, stats);
+        }
+
+        if (!due.empty()) {
+            n = take_batch(due, batch, limit);
+            run_batch(batch, stats);
+
+            if (n == limit) {
+                return n;
+            }
+        }
+
+        // Only what was queued when we got here, so expired timers don't wait behind new arrivals.
+        // The lane is chosen again for every entry, an interactive task waits for one task at most.
+        size_t queued = 0;
+        for (size_t i = 0; i < dispatch_qos_count; ++i) {
+            size_t depth = queue_depth((DispatchQos) i);
+            if (stats != nullptr && depth > depth_high[i].load(std::memory_order_relaxed)) {
+                depth_high[i].store(depth, std::memory_order_relaxed);
+            }
+            queued += depth;
+        }
+
+        dispatch_que_work_entry work;
+        for (size_t todo = std::min(limit - n, queued); todo > 0; --todo) {
+            int i = pick_lane(passed, [this](size_t i) { return !lane_empty(lanes[i]); });
+            if (i < 0 || !pop(lanes[i], work)) {
+                break;
+            }
+            run_entry(work, stats);
+            n++;
+        }
+
+        return n;
+    }
+
+    bool DispatchQueue::serial_impl::lane_empty(lane const &l) const {
+        return l.stash.empty() && l.ring.empty() && l.overflow_size.load(std::memory_order_acquire) == 0;
+    }
+
+    bool DispatchQueue::serial_impl::pop(lane &l, dispatch_que_work_entry &work) {
+        if (l.stash.empty()) {
+            if (l.ring.try_pop(work)) {
+                return true;
+            }
+            if (l.overflow_size.load(std::memory_order_acquire) == 0) {
+                return false;
+            }
+
+            // The ring is drained, the overflow is next. Taking all of it sends producers back to the ring.
+            work_queue_lock _(work_queue_mtx);
+            if (capacity.load(std::memory_order_relaxed) != 0) {
+                // Unless bounded: then one at a time, which may find it evicted meanwhile.
+                if (l.overflow.empty()) {
+                    return false;
+                }
+                work = std::move(l.overflow.back());
+                l.overflow.pop_back();
+                l.overflow_size.fetch_sub(1);
+                if (work.counted) {
+                    bounded_size--;
+                    if (space_waiters > 0) {
+                        space_cond.notify_one();
+                    }
+                }
+                return true;
+            }
+            l.stash.swap(l.overflow);
+            l.stashed.store(l.stash.size(), std::memory_order_relaxed);
+            l.overflow_size.fetch_sub(l.stash.size());
+        }
+
+        work = std::move(l.stash.back());
+        l.stash.pop_back();
+        l.stashed.store(l.stash.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    size_t DispatchQueue::serial_impl::queue_depth(DispatchQos qos) const {
+        lane const &l = lanes[(size_t) qos];
+        return l.ring.size_approx() + l.overflow_size.load(std::memory_order_relaxed) +
+               l.stashed.load(std::memory_order_relaxed);
+    }
+
+    void DispatchQueue::serial_impl::run_entry(dispatch_que_work_entry &work, dispatch_que_stats *stats) {
+        if (work.kind == dispatch_que_work_entry::timer_add || work.kind == dispatch_que_work_entry::timer_cancel) {
+            timers.apply(work);
+        } else {
+            run_task(work, stats);
+        }
+    }
+
+    void DispatchQueue::serial_impl::stats(DispatchQueueStats &out) const {
+        measured.wait.snapshot(out.wait);
+        measured.run.snapshot(out.run);
+        measured.lateness.snapshot(out.timer_lateness);
+        for (size_t i = 0; i < dispatch_qos_count; ++i) {
+            out.depth[i] = queue_depth((DispatchQos) i);
+            out.depth_high_water[i] = depth_high[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    bool DispatchQueue::serial_impl::has_work() const {
+        for (auto &l : lanes) {
+            if (!lane_empty(l)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void DispatchQueue::serial_impl::wake_worker() {
+        // Pairs with the fence in dispatch_thread_proc: either we see the worker parked,
+        // or it sees our entry before going to sleep. Only the first producer to notice pays for the wakeup.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_relaxed) && parked.exchange(false)) {
+            work_queue_lock _(work_queue_mtx);
+            work_queue_cond.notify_one();
+        }
+    }
+
+    void DispatchQueue::serial_impl::dispatch_thread_proc(DispatchQueue::serial_impl *self, ThreadOptions thread) {
+        apply_thread_options_or_warn(thread);
+        current_queue = self;
+        {
+            work_queue_lock _(self->work_queue_mtx);
+            self->work_queue_thread_started = true;
+            self->work_queue_cond.notify_one();
+        }
+
+        // quit is set by a task, whatever was queued in other lanes still runs before we leave.
+        while (true) {
+            if (self->run_pending() > 0) {
+                continue;
+            }
+            if (self->quit) {
+                break;
+            }
+
+            // Nothing left, park until a producer wakes us or the next timer is due.
+            auto deadline = self->timers.next_wakeup();
+            // The flag is re-armed on every pass: a producer that saw it set may only get to notify
+            // after its entry was already run, and that wakeup must not leave us asleep unflagged.
+            work_queue_lock work_queue_lock(self->work_queue_mtx);
+            while (true) {
+                self->parked.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (self->has_work()) {
+                    break;
+                }
+                if (deadline == time_point::max()) {
+                    self->work_queue_cond.wait(work_queue_lock);
+                } else if (self->work_queue_cond.wait_until(work_queue_lock, deadline) == std::cv_status::timeout) {
+                    break;
+                }
+            }
+            self->parked.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    DispatchQueue::serial_impl::serial_impl(ThreadOptions const &thread)
+            : passed(), work_queue_thread_started(false), parked(false) {
+        for (auto &high : depth_high) {
+            high = 0;
+        }
+
+        work_queue_lock work_queue_lock(work_queue_mtx);
+        work_queue_thread = std::thread(dispatch_thread_proc, this, thread);
+        work_queue_cond.wait(work_queue_lock, [this] { return work_queue_thread_started.load(); });
+    }
+
+    void DispatchQueue::serial_impl::shutdown() {
+        detach_anchor();
+        dispatch_async(dispatch_que_work_entry([this] { quit = true; }), DispatchQos::normal);
+        work_queue_thread.join();
+    }
+
+    // Interactive, so a flood of queued work does not hold up arming a timer.
+    void DispatchQueue::serial_impl::dispatch_timer(dispatch_que_work_entry work) {
+        dispatch_async(std::move(work), DispatchQos::interactive);
+    }
+
+    void DispatchQueue::serial_impl::dispatch_async(dispatch_que_work_entry work, DispatchQos qos) {
+        stamp(work);
+        lane &l = lanes[(size_t) qos];
+        if (l.overflow_size.load(std::memory_order_acquire) > 0 || !l.ring.try_push(work)) {
+            work_queue_lock _(work_queue_mtx);
+            l.overflow.push_front(std::move(work));
+            l.overflow_size.fetch_add(1);
+            work_queue_cond.notify_one();
+            return;
+        }
+
+        wake_worker();
+    }
+
+    bool DispatchQueue::serial_impl::dispatch_bounded(dispatch_que_work_entry work, DispatchQos qos, bool try_only) {
+        stamp(work);
+        size_t cap = capacity.load(std::memory_order_relaxed);
+        dispatch_que_work_entry evicted;
+        {
+            work_queue_lock lock(work_queue_mtx);
+            while (cap != 0 && bounded_size >= cap) {
+                DispatchOverflow policy = overflow_policy.load(std::memory_order_relaxed);
+                if (try_only || policy == DispatchOverflow::reject) {
+                    lock.unlock();
+                    return reject(work);
+                }
+                if (policy == DispatchOverflow::drop_oldest) {
+                    evict_oldest(evicted);
+                    break;
+                }
+                // The worker waiting for itself to make room would wait forever.
+                if (current_queue == this) {
+                    break;
+                }
+                space_waiters++;
+                space_cond.wait(lock);
+                space_waiters--;
+            }
+
+            lane &l = lanes[(size_t) qos];
+            work.counted = true;
+            l.overflow.push_front(std::move(work));
+            l.overflow_size.fetch_add(1);
+            bounded_size++;
+            work_queue_cond.notify_one();
+        }
+
+        // Released outside the lock, its destructor may well post to this queue.
+        if (evicted.counted) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            discard_task(evicted);
+        }
+        return true;
+    }
+
+    // Under work_queue_mtx: takes the oldest counted entry of the lowest lane that has one.
+    bool DispatchQueue::serial_impl::evict_oldest(dispatch_que_work_entry &evicted) {
+        for (size_t i = dispatch_qos_count; i-- > 0;) {
+            lane &l = lanes[i];
+            // Oldest at the back.
+            for (auto it = l.overflow.rbegin(); it != l.overflow.rend(); ++it) {
+                if (it->counted) {
+                    evicted = std::move(*it);
+                    l.overflow.erase(std::next(it).base());
+                    l.overflow_size.fetch_sub(1);
+                    bounded_size--;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Concurrent queue
+
+    struct DispatchQueue::concurrent_impl : DispatchQueue::impl {
+        struct worker {
+            concurrent_impl *owner;
+            size_t index;
+            std::mutex mtx;
+            // One deque per DispatchQos. The owner pops from the front, thieves take from the back.
+            std::deque<dispatch_que_work_entry> local[dispatch_qos_count];
+            // Owner only, see pick_lane.
+            size_t passed[dispatch_qos_count];
+            dispatch_que_stats measured;
+            std::thread thread;
+        };
+
+        concurrent_impl(int nworkers, ThreadOptions const &thread);
+
+        void dispatch_async(dispatch_que_work_entry work, DispatchQos qos) override;
+
+        bool dispatch_bounded(dispatch_que_work_entry work, DispatchQos qos, bool try_only) override;
+
+        void dispatch_timer(dispatch_que_work_entry work) override;
+
+        void dispatch_barrier(dispatch_que_work_entry work) override;
+
+        void dispatch_flush() override;
+
+        void shutdown() override;
+
+        size_t queue_depth(DispatchQos qos) const override;
+
+        size_t concurrency() const override {
+            return workers.size();
+        }
+
+        void stats(DispatchQueueStats &out) const override;
+
+        void service_timers(worker *w);
+
+        void wake_one();
+
+        void submit(worker *w, dispatch_que_work_entry work, DispatchQos qos, bool front);
+
+        void finish(size_t n);
+
+        void release_held();
+
+        void push(worker *w, dispatch_que_work_entry work, DispatchQos qos, bool front);
+
+        size_t take_local(worker *w, dispatch_que_batch &batch);
+
+        bool steal(worker *w, dispatch_que_batch &batch);
+
+        void evict_oldest();
+
+        void release_room(dispatch_que_batch const &batch);
+
+        static void worker_thread_proc(concurrent_impl *self, worker *w, ThreadOptions thread);
+
+        std::vector<std::unique_ptr<worker> > workers;
+        std::atomic<size_t> next_worker;
+        // Entries sitting in some deque, in total and per lane.
+        std::atomic<size_t> pending;
+        std::atomic<size_t> lane_pending[dispatch_qos_count];
+        std::atomic<size_t> depth_high[dispatch_qos_count];
+        // Entries queued or running, dispatch_flush waits for it to drop to zero.
+        std::atomic<size_t> inflight;
+        std::atomic<int> sleepers;
+
+        std::mutex idle_mtx;
+        std::condition_variable idle_cond;
+        std::condition_variable flush_cond;
+
+        // Counted entries not yet taken by a worker, reserved before they are queued. Producers blocked
+        // on a full queue wait on space_cond under idle_mtx.
+        std::atomic<size_t> bounded_size;
+        std::atomic<int> space_waiters;
+        std::condition_variable space_cond;
+
+        // From the first dispatch_barrier_async until the last one queued returned, submissions are
+        // held here in order and released up to the next barrier whenever inflight drops to zero.
+        struct held_entry {
+            dispatch_que_work_entry work;
+            DispatchQos qos;
+        };
+        std::mutex barrier_mtx;
+        std::deque<held_entry> held;
+        std::atomic<bool> barrier_active;
+        bool barrier_running;
+
+        // Delayed work belongs to whichever worker gets wheel_mtx, taken with try_lock so no worker
+        // ever waits for it; dispatch_after hands it over through timer_inbox.
+        std::mutex timer_mtx;
+        std::vector<dispatch_que_work_entry> timer_inbox;
+        std::atomic<size_t> timer_inbox_size;
+        std::mutex wheel_mtx;
+        dispatch_timers timers;
+        dispatch_que_batch due;
+        // timers.next_wakeup(), readable without wheel_mtx.
+        std::atomic<std::chrono::steady_clock::rep> timer_next;
+        // Under idle_mtx: one idle worker sleeps on timer_cond until timer_next, the others on idle_cond.
+        bool timer_sleeper;
+        std::condition_variable timer_cond;
+
+        using idle_lock = std::unique_lock<decltype(idle_mtx)>;
+        using worker_lock = std::unique_lock<std::mutex>;
+
+        static thread_local worker *current;
+    };
+
+    thread_local DispatchQueue::concurrent_impl::worker *DispatchQueue::concurrent_impl::current = nullptr;
+
+    DispatchQueue::concurrent_impl::concurrent_impl(int nworkers, ThreadOptions const &thread)
+            : next_worker(0), pending(0), inflight(0), sleepers(0), bounded_size(0), space_waiters(0),
+              barrier_active(false), barrier_running(false), timer_inbox_size(0),
+              timer_next(std::chrono::steady_clock::time_point::max().time_since_epoch().count()),
+              timer_sleeper(false) {
+        if (nworkers <= 0) {
+            nworkers = std::max(1, (int) std::thread::hardware_concurrency());
+        }
+
+        for (size_t i = 0; i < dispatch_qos_count; ++i) {
+            lane_pending[i] = 0;
+            depth_high[i] = 0;
+        }
+
+        for (int i = 0; i < nworkers; ++i) {
+            std::unique_ptr<worker> w(new worker());
+            w->owner = this;
+            w->index = i;
+            workers.push_back(std::move(w));
+        }
+
+        for (auto &w : workers) {
+            ThreadOptions options = thread;
+            if (!options.name.empty()) {
+                options.name += "-" + std::to_string(w->index);
+            }
+            w->thread = std::thread(worker_thread_proc, this, w.get(), std::move(options));
+        }
+    }
+
+    // Whichever worker gets the wheel files new delayed work and queues what is due at the front of
+    // its interactive deque. The others go on with their tasks.
+    void DispatchQueue::concurrent_impl::service_timers(worker *w) {
+        auto now = std::chrono::steady_clock::now();
+        auto next = timer_next.load();
+        if (timer_inbox_size.load(std::memory_order_acquire) == 0 && now.time_since_epoch().count() < next) {
+            return;
+        }
+        std::unique_lock<std::mutex> wheel(wheel_mtx, std::try_to_lock);
+        if (!wheel.owns_lock()) {
+            return;
+        }
+
+        if (timer_inbox_size.load(std::memory_order_acquire) > 0) {
+            std::vector<dispatch_que_work_entry> inbox;
+            {
+                std::unique_lock<std::mutex> _(timer_mtx);
+                inbox.swap(timer_inbox);
+                timer_inbox_size = 0;
+            }
+            for (auto &work : inbox) {
+                timers.apply(work);
+            }
+        }
+
+        if (!timers.empty()) {
+            timers.expire(now, due, measuring(w->measured));
+            // Newest first, so the earliest ends up at the very front.
+            while (!due.empty()) {
+                submit(w, std::move(due.front()), DispatchQos::interactive, true);
+                due.pop_front();
+            }
+        }
+
+        auto wakeup = timers.next_wakeup().time_since_epoch().count();
+        timer_next.store(wakeup);
+        // The worker asleep on the wheel waits for a later deadline.
+        if (wakeup < next) {
+            idle_lock _(idle_mtx);
+            if (timer_sleeper) {
+                timer_cond.notify_one();
+            }
+        }
+    }
+
+    // Under idle_mtx: wakes a worker for new work, the one asleep on the wheel only if it is the last.
+    void DispatchQueue::concurrent_impl::wake_one() {
+        if (sleepers.load() > (timer_sleeper ? 1 : 0)) {
+            idle_cond.notify_one();
+        } else if (timer_sleeper) {
+            timer_cond.notify_one();
+        }
+    }
+
+    // Counts the entry in flight and queues it, unless a barrier is in the way.
+    void DispatchQueue::concurrent_impl::submit(worker *w, dispatch_que_work_entry work, DispatchQos qos, bool front) {
+        // Pairs with dispatch_barrier and release_held: either we see the barrier, or it sees our entry in flight.
+        inflight.fetch_add(1);
+        if (barrier_active.load()) {
+            bool was_held = false;
+            {
+                std::unique_lock<std::mutex> _(barrier_mtx);
+                if (barrier_active.load()) {
+                    held.push_back(held_entry{std::move(work), qos});
+                    was_held = true;
+                }
+            }
+            if (was_held) {
+                finish(1);
+                return;
+            }
+        }
+
+        push(w, std::move(work), qos, front);
+    }
+
+    // Whoever brings inflight to zero lets the held entries go and wakes dispatch_flush.
+    void DispatchQueue::concurrent_impl::finish(size_t n) {
+        if (inflight.fetch_sub(n) == n) {
+            if (barrier_active.load()) {
+                release_held();
+            }
+
+            idle_lock _(idle_mtx);
+            flush_cond.notify_all();
+        }
+    }
+
+    // Queues held entries up to the next barrier. The barrier itself goes once nothing else is in flight,
+    // and everything behind it stays held until it returned.
+    void DispatchQueue::concurrent_impl::release_held() {
+        std::unique_lock<std::mutex> _(barrier_mtx);
+        while (!held.empty() && !barrier_running) {
+            held_entry &h = held.front();
+            if (h.work.kind == dispatch_que_work_entry::barrier) {
+                if (inflight.load() != 0) {
+                    break;
+                }
+                barrier_running = true;
+            }
+
+            inflight.fetch_add(1);
+            push(workers[next_worker.fetch_add(1) % workers.size()].get(), std::move(h.work), h.qos, false);
+            held.pop_front();
+        }
+
+        if (held.empty() && !barrier_running) {
+            barrier_active = false;
+        }
+    }
+
+    void DispatchQueue::concurrent_impl::push(worker *w, dispatch_que_work_entry work, DispatchQos qos, bool front) {
+        {
+            worker_lock _(w->mtx);
+            if (front) {
+                w->local[(size_t) qos].push_front(std::move(work));
+            } else {
+                w->local[(size_t) qos].push_back(std::move(work));
+            }
+        }
+
+        size_t depth = lane_pending[(size_t) qos].fetch_add(1) + 1;
+        if (stats_enabled.load(std::memory_order_relaxed)) {
+            size_t high = depth_high[(size_t) qos].load(std::memory_order_relaxed);
+            while (depth > high && !depth_high[(size_t) qos].compare_exchange_weak(high, depth)) {
+            }
+        }
+        pending.fetch_add(1);
+        if (sleepers.load() > 0) {
+            idle_lock _(idle_mtx);
+            wake_one();
+        }
+    }
+
+    // Takes a batch from the front of one of the worker's own deques, picked by pick_lane.
+    // At most half of it is taken so the rest stays visible to thieves.
+    size_t DispatchQueue::concurrent_impl::take_local(worker *w, dispatch_que_batch &batch) {
+        worker_lock _(w->mtx);
+        int lane = pick_lane(w->passed, [w](size_t i) { return !w->local[i].empty(); });
+        if (lane < 0) {
+            return 0;
+        }
+
+        auto &local = w->local[lane];
+        size_t n = std::min(batch_limit(max_batch), (local.size() + 1) / 2);
+        for (size_t i = 0; i < n; ++i) {
+            batch.push_front(std::move(local.front()));
+            local.pop_front();
+        }
+
+        lane_pending[lane].fetch_sub(n);
+        pending.fetch_sub(n);
+        return n;
+    }
+
+    // Takes one entry from the back of another worker, highest lane first.
+    bool DispatchQueue::concurrent_impl::steal(worker *w, dispatch_que_batch &batch) {
+        size_t n = workers.size();
+        for (size_t i = 1; i < n; ++i) {
+            worker *victim = workers[(w->index + i) % n].get();
+            worker_lock _(victim->mtx);
+            for (size_t lane = 0; lane < dispatch_qos_count; ++lane) {
+                if (!victim->local[lane].empty()) {
+                    batch.push_front(std::move(victim->local[lane].back()));
+                    victim->local[lane].pop_back();
+                    lane_pending[lane].fetch_sub(1);
+                    pending.fetch_sub(1);
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    // Drops the oldest counted entry of the lowest lane that has one, from the first worker found holding one.
+    void DispatchQueue::concurrent_impl::evict_oldest() {
+        dispatch_que_work_entry evicted;
+        for (size_t lane = dispatch_qos_count; lane-- > 0 && !evicted.counted;) {
+            for (auto &w : workers) {
+                worker_lock _(w->mtx);
+                auto &local = w->local[lane];
+                auto it = std::find_if(local.begin(), local.end(),
+                                       [](dispatch_que_work_entry const &e) { return e.counted; });
+                if (it != local.end()) {
+                    evicted = std::move(*it);
+                    local.erase(it);
+                    lane_pending[lane].fetch_sub(1);
+                    pending.fetch_sub(1);
+                    break;
+                }
+            }
+        }
+
+        if (evicted.counted) {
+            bounded_size.fetch_sub(1);
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            discard_task(evicted);
+            finish(1);
+        }
+    }
+
+    // After a worker took batch: its counted entries no longer hold room in the queue.
+    void DispatchQueue::concurrent_impl::release_room(dispatch_que_batch const &batch) {
+        size_t n = 0;
+        for (auto &work : batch) {
+            n += work.counted;
+        }
+        if (n == 0) {
+            return;
+        }
+
+        // Pairs with the wait in dispatch_bounded: either we see the waiter, or it sees the room.
+        bounded_size.fetch_sub(n);
+        if (space_waiters.load() > 0) {
+            idle_lock _(idle_mtx);
+            space_cond.notify_all();
+        }
+    }
+
+    size_t DispatchQueue::concurrent_impl::queue_depth(DispatchQos qos) const {
+        return lane_pending[(size_t) qos].load(std::memory_order_relaxed);
+    }
+
+    void DispatchQueue::concurrent_impl::stats(DispatchQueueStats &out) const {
+        for (auto &w : workers) {
+            w->measured.wait.snapshot(out.wait);
+            w->measured.run.snapshot(out.run);
+            w->measured.lateness.snapshot(out.timer_lateness);
+        }
+        for (size_t i = 0; i < dispatch_qos_count; ++i) {
+            out.depth[i] = queue_depth((DispatchQos) i);
+            out.depth_high_water[i] = depth_high[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    void DispatchQueue::concurrent_impl::worker_thread_proc(concurrent_impl *self, worker *w, ThreadOptions thread) {
+        apply_thread_options_or_warn(thread);
+        current = w;
+        current_queue = self;
+        dispatch_que_batch batch;
+
+        while (true) {
+            self->service_timers(w);
+
+            size_t n = self->take_local(w, batch);
+            if (n == 0 && self->steal(w, batch)) {
+                n = 1;
+            }
+
+            if (n > 0) {
+                self->release_room(batch);
+                dispatch_que_stats *stats = self->measuring(w->measured);
+                while (!batch.empty()) {
+                    bool barrier = batch.back().kind == dispatch_que_work_entry::barrier;
+                    run_task(batch.back(), stats);
+                    batch.pop_back();
+                    if (barrier) {
+                        std::unique_lock<std::mutex> _(self->barrier_mtx);
+                        self->barrier_running = false;
+                    }
+                }
+
+                self->finish(n);
+                continue;
+            }
+
+            // The first worker to go idle while timers are armed sleeps until the next one is due.
+            const auto never = std::chrono::steady_clock::time_point::max().time_since_epoch().count();
+            idle_lock idle_lock(self->idle_mtx);
+            self->sleepers.fetch_add(1);
+            auto next = self->timer_next.load();
+            if (next != never && !self->timer_sleeper) {
+                self->timer_sleeper = true;
+                self->timer_cond.wait_until(idle_lock, std::chrono::steady_clock::time_point(
+                        std::chrono::steady_clock::duration(next)), [&] {
+                    return self->quit || self->pending.load() > 0 || self->timer_inbox_size.load() > 0 ||
+                           self->timer_next.load() < next;
+                });
+                self->timer_sleeper = false;
+                // Off to work: another idle worker takes over the wheel.
+                if (self->pending.load() > 0 && self->sleepers.load() > 1 && self->timer_next.load() != never) {
+                    self->idle_cond.notify_one();
+                }
+            } else {
+                self->idle_cond.wait(idle_lock, [&] {
+                    return self->quit || self->pending.load() > 0 || self->timer_inbox_size.load() > 0 ||
+                           (!self->timer_sleeper && self->timer_next.load() != never);
+                });
+            }
+            self->sleepers.fetch_sub(1);
+
+            if (self->quit && self->pending.load() == 0) {
+                break;
+            }
+        }
+
+        current = nullptr;
+        current_queue = nullptr;
+    }
+
+    void DispatchQueue::concurrent_impl::dispatch_async(dispatch_que_work_entry work, DispatchQos qos) {
+        stamp(work);
+        // Work spawned by a worker stays local, everything else is spread round robin.
+        worker *w = current;
+        if (w == nullptr || w->owner != this) {
+            w = workers[next_worker.fetch_add(1) % workers.size()].get();
+        }
+
+        submit(w, std::move(work), qos, false);
+    }
+
+    // Room is reserved before the entry is queued, so the capacity holds exactly.
+    bool DispatchQueue::concurrent_impl::dispatch_bounded(dispatch_que_work_entry work, DispatchQos qos, bool try_only) {
+        size_t cap = capacity.load(std::memory_order_relaxed);
+        while (cap != 0 && bounded_size.fetch_add(1) >= cap) {
+            bounded_size.fetch_sub(1);
+            DispatchOverflow policy = overflow_policy.load(std::memory_order_relaxed);
+            if (try_only || policy == DispatchOverflow::reject) {
+                return reject(work);
+            }
+            if (policy == DispatchOverflow::drop_oldest) {
+                // Takes the room of the one evicted. When there is none to evict, every counted
+                // entry is held behind a barrier or being taken, and we go over by one.
+                bounded_size.fetch_add(1);
+                evict_oldest();
+                break;
+            }
+            // A worker waiting for the queue to make room might be the one that has to make it.
+            if (current_queue == this) {
+                bounded_size.fetch_add(1);
+                break;
+            }
+
+            idle_lock lock(idle_mtx);
+            space_waiters.fetch_add(1);
+            space_cond.wait(lock, [&] { return bounded_size.load() < cap; });
+            space_waiters.fetch_sub(1);
+        }
+
+        work.counted = cap != 0;
+        dispatch_async(std::move(work), qos);
+        return true;
+    }
+
+    void DispatchQueue::concurrent_impl::dispatch_barrier(dispatch_que_work_entry work) {
+        stamp(work);
+        work.kind = dispatch_que_work_entry::barrier;
+        {
+            std::unique_lock<std::mutex> _(barrier_mtx);
+            held.push_back(held_entry{std::move(work), DispatchQos::normal});
+            barrier_active = true;
+        }
+
+        // Nothing in flight, nobody else is going to release it.
+        release_held();
+    }
+
+    void DispatchQueue::concurrent_impl::dispatch_timer(dispatch_que_work_entry work) {
+        {
+            std::unique_lock<std::mutex> _(timer_mtx);
+            timer_inbox.push_back(std::move(work));
+            timer_inbox_size.fetch_add(1);
+        }
+
+        // The worker asleep on the wheel may be waiting for a later deadline, else any idle one files it.
+        idle_lock _(idle_mtx);
+        if (timer_sleeper) {
+            timer_cond.notify_one();
+        } else if (sleepers.load() > 0) {
+            idle_cond.notify_one();
+        }
+    }
+
+    void DispatchQueue::concurrent_impl::dispatch_flush() {
+        // A worker waiting for the queue to drain would wait for itself.
+        if (current_queue == this) {
+            return;
+        }
+
+        idle_lock idle_lock(idle_mtx);
+        flush_cond.wait(idle_lock, [this] { return inflight.load() == 0 && !barrier_active.load(); });
+    }
+
+    void DispatchQueue::concurrent_impl::shutdown() {
+        detach_anchor();
+        dispatch_flush();
+
+        {
+            idle_lock _(idle_mtx);
+            quit = true;
+            idle_cond.notify_all();
+            timer_cond.notify_all();
+        }
+
+        for (auto &w : workers) {
+            w->thread.join();
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Pooled serial queue
+
+    // Tasks a pooled queue runs per drain before it lets the other queues on the pool have the worker.
+    static const size_t dispatch_pooled_quantum = 64;
+
+    // One lane of a pooled queue: a vector consumed from the front. An idle queue holds no storage,
+    // what a burst allocated is given back once it drained.
+    struct dispatch_que_fifo {
+        std::vector<dispatch_que_work_entry> items;
+        size_t head = 0;
+
+        bool empty() const {
+            return head == items.size();
+        }
+
+        size_t size() const {
+            return items.size() - head;
+        }
+
+        void push(dispatch_que_work_entry work) {
+            // Reuse the consumed front rather than growing, once it is half of the vector.
+            if (items.size() == items.capacity() && head > 0 && head >= items.size() / 2) {
+                items.erase(items.begin(), items.begin() + head);
+                head = 0;
+            }
+            items.push_back(std::move(work));
+        }
+
+        void pop(dispatch_que_work_entry &work) {
+            work = std::move(items[head++]);
+            if (empty()) {
+                reset();
+            }
+        }
+
+        // Takes the oldest entry counted against the capacity.
+        bool evict_counted(dispatch_que_work_entry &evicted) {
+            for (size_t i = head; i < items.size(); ++i) {
+                if (items[i].counted) {
+                    evicted = std::move(items[i]);
+                    items.erase(items.begin() + i);
+                    if (empty()) {
+                        reset();
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void reset() {
+            head = 0;
+            if (items.capacity() > dispatch_pooled_quantum) {
+                std::vector<dispatch_que_work_entry>().swap(items);
+            } else {
+                items.clear();
+            }
+        }
+    };
+
+    // State of a pooled queue shared with its drain tasks, so one still sitting in the target after
+    // the queue is gone finds the lanes empty instead of freed memory.
+    struct dispatch_pooled_core {
+        std::mutex mtx;
+        // Signalled when a drain ends and when room frees up in a bounded queue.
+        std::condition_variable cond;
+        dispatch_que_fifo lanes[dispatch_qos_count];
+        // Belongs to whoever is draining, see pick_lane.
+        size_t passed[dispatch_qos_count] = {};
+        size_t depth_high[dispatch_qos_count] = {};
+        // Drain tasks posted to the target and not run yet, and the qos of the latest one.
+        int scheduled = 0;
+        DispatchQos scheduled_qos = DispatchQos::background;
+        // Whoever sets it runs the tasks, it is what keeps them one at a time.
+        bool draining = false;
+        size_t bounded_size = 0;
+        int space_waiters = 0;
+
+        bool empty() const {
+            for (auto &lane : lanes) {
+                if (!lane.empty()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        int highest() const {
+            for (size_t i = 0; i < dispatch_qos_count; ++i) {
+                if (!lanes[i].empty()) {
+                    return (int) i;
+                }
+            }
+            return -1;
+        }
+    };
+
+    // Serial queue without threads of its own. Its tasks run on the target's threads, one at a time
+    // and in order, through a drain task posted to the target whenever there is work; idle it costs
+    // the core and nothing else. Delayed work is filed with the target's timers.
+    struct DispatchQueue::pooled_impl : DispatchQueue::impl {
+        using core_lock = std::unique_lock<std::mutex>;
+
+        explicit pooled_impl(std::shared_ptr<DispatchQueue> target);
+
+        ~pooled_impl() override;
+
+        void dispatch_async(dispatch_que_work_entry work, DispatchQos qos) override;
+
+        bool dispatch_bounded(dispatch_que_work_entry work, DispatchQos qos, bool try_only) override;
+
+        void dispatch_timer(dispatch_que_work_entry work) override;
+
+        void shutdown() override;
+
+        size_t queue_depth(DispatchQos qos) const override;
+
+        void stats(DispatchQueueStats &out) const override;
+
+        bool enqueue(dispatch_que_work_entry work, DispatchQos qos);
+
+        void schedule(DispatchQos qos);
+
+        static void drain(pooled_impl *self, std::shared_ptr<dispatch_pooled_core> const &core);
+
+        static void run_some(pooled_impl *self, dispatch_pooled_core &core, size_t limit);
+
+        std::shared_ptr<DispatchQueue> target;
+        std::shared_ptr<dispatch_pooled_core> core;
+        // Allocated by the first drain that measures.
+        std::atomic<dispatch_que_stats *> measured;
+    };
+
+    DispatchQueue::pooled_impl::pooled_impl(std::shared_ptr<DispatchQueue> target_)
+            : target(std::move(target_)), core(std::make_shared<dispatch_pooled_core>()), measured(nullptr) {
+    }
+
+    DispatchQueue::pooled_impl::~pooled_impl() {
+        delete measured.load();
+    }
+
+    // Under core->mtx. True when the caller has to post a drain at qos: none is scheduled, or only at
+    // a lower qos, where this task would wait behind the target's lower lanes.
+    bool DispatchQueue::pooled_impl::enqueue(dispatch_que_work_entry work, DispatchQos qos) {
+        size_t i = (size_t) qos;
+        core->lanes[i].push(std::move(work));
+        if (stats_enabled.load(std::memory_order_relaxed) && core->lanes[i].size() > core->depth_high[i]) {
+            core->depth_high[i] = core->lanes[i].size();
+        }
+
+        if (core->scheduled > 0 && qos >= core->scheduled_qos) {
+            return false;
+        }
+        core->scheduled++;
+        core->scheduled_qos = qos;
+        return true;
+    }
+
+    void DispatchQueue::pooled_impl::schedule(DispatchQos qos) {
+        std::shared_ptr<dispatch_pooled_core> shared = core;
+        target->m->dispatch_async(dispatch_que_work_entry([this, shared] { drain(this, shared); }), qos);
+    }
+
+    // A drain that finds another one running just leaves, the running one posts a new drain if it
+    // stops with work left.
+    void DispatchQueue::pooled_impl::drain(pooled_impl *self, std::shared_ptr<dispatch_pooled_core> const &core) {
+        {
+            core_lock _(core->mtx);
+            if (core->draining) {
+                core->scheduled--;
+                return;
+            }
+            core->draining = true;
+        }
+
+        run_some(self, *core, dispatch_pooled_quantum);
+
+        // Posted under the lock: work left means the queue is alive, but only until shutdown gets the lock.
+        core_lock _(core->mtx);
+        core->draining = false;
+        core->scheduled--;
+        int next = core->highest();
+        if (next >= 0 && core->scheduled == 0) {
+            core->scheduled++;
+            core->scheduled_qos = (DispatchQos) next;
+            self->schedule((DispatchQos) next);
+        }
+        core->cond.notify_all();
+    }
+
+    // Runs up to limit tasks, by the caller holding draining. self is only touched once there is a
+    // task, a drain left over from a queue already gone finds none.
+    void DispatchQueue::pooled_impl::run_some(pooled_impl *self, dispatch_pooled_core &core, size_t limit) {
+        impl *outer = current_queue;
+        dispatch_que_stats *stats = nullptr;
+        dispatch_que_work_entry work;
+        for (size_t n = 0; n < limit; ++n) {
+            {
+                core_lock _(core.mtx);
+                int i = pick_lane(core.passed, [&core](size_t i) { return !core.lanes[i].empty(); });
+                if (i < 0) {
+                    break;
+                }
+                core.lanes[i].pop(work);
+                if (work.counted) {
+                    core.bounded_size--;
+                    if (core.space_waiters > 0) {
+                        core.cond.notify_all();
+                    }
+                }
+            }
+
+            if (n == 0) {
+                limit = std::min(limit, batch_limit(self->max_batch));
+                current_queue = self;
+                if (self->stats_enabled.load(std::memory_order_relaxed)) {
+                    stats = self->measured.load(std::memory_order_acquire);
+                    if (stats == nullptr) {
+                        stats = new dispatch_que_stats();
+                        self->measured.store(stats, std::memory_order_release);
+                    }
+                }
+            }
+            run_task(work, stats);
         }
+        current_queue = outer;
+    }
 
-        dispatch_que_work_entry(std::function<void()> func_, time_point expiry_)
-                : func(std::move(func_)), expiry(expiry_), from_timer(true) {
+    void DispatchQueue::pooled_impl::dispatch_async(dispatch_que_work_entry work, DispatchQos qos) {
+        stamp(work);
+        bool post;
+        {
+            core_lock _(core->mtx);
+            post = enqueue(std::move(work), qos);
         }
+        if (post) {
+            schedule(qos);
+        }
+    }
 
-        std::function<void()> func;
-        time_point expiry;
-        bool from_timer;
-    };
+    bool DispatchQueue::pooled_impl::dispatch_bounded(dispatch_que_work_entry work, DispatchQos qos, bool try_only) {
+        stamp(work);
+        size_t cap = capacity.load(std::memory_order_relaxed);
+        dispatch_que_work_entry evicted;
+        bool post;
+        {
+            core_lock lock(core->mtx);
+            while (cap != 0 && core->bounded_size >= cap) {
+                DispatchOverflow policy = overflow_policy.load(std::memory_order_relaxed);
+                if (try_only || policy == DispatchOverflow::reject) {
+                    lock.unlock();
+                    return reject(work);
+                }
+                if (policy == DispatchOverflow::drop_oldest) {
+                    for (size_t i = dispatch_qos_count; i-- > 0;) {
+                        if (core->lanes[i].evict_counted(evicted)) {
+                            core->bounded_size--;
+                            break;
+                        }
+                    }
+                    break;
+                }
+                // The queue waiting for itself to make room would wait forever.
+                if (current_queue == this) {
+                    break;
+                }
+                core->space_waiters++;
+                core->cond.wait(lock);
+                core->space_waiters--;
+            }
+
+            work.counted = true;
+            core->bounded_size++;
+            post = enqueue(std::move(work), qos);
+        }
 
-    bool operator>(dispatch_que_work_entry const &lhs, dispatch_que_work_entry const &rhs) {
-        return lhs.expiry > rhs.expiry;
+        if (evicted.counted) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            discard_task(evicted);
+        }
+        if (post) {
+            schedule(qos);
+        }
+        return true;
     }
 
-    struct DispatchQueue::impl {
-        impl();
+    // The target's timers own the deadline. A due timer posts the task back here, unless this queue
+    // is gone by then; cancelling unlinks it from the target's timers the same way.
+    void DispatchQueue::pooled_impl::dispatch_timer(dispatch_que_work_entry work) {
+        if (work.kind == dispatch_que_work_entry::timer_add) {
+            // Still ours alone: dispatch_after has not handed out the DispatchTimer yet.
+            std::weak_ptr<dispatch_timer_anchor> anchor = work.timer->anchor;
+            work.timer->func = Closure([anchor, func = std::move(work.timer->func)]() mutable {
+                if (auto a = anchor.lock()) {
+                    std::unique_lock<std::mutex> _(a->mtx);
+                    if (a->queue != nullptr) {
+                        a->queue->m->dispatch_async(dispatch_que_work_entry(std::move(func)), DispatchQos::interactive);
+                    }
+                }
+            });
+        }
+        target->m->dispatch_timer(std::move(work));
+    }
 
-        static void dispatch_thread_proc(impl *self);
+    // Runs what is left right here rather than waiting on the target, whose threads may all be busy,
+    // this one included.
+    void DispatchQueue::pooled_impl::shutdown() {
+        detach_anchor();
 
-        static void timer_thread_proc(impl *self);
+        core_lock lock(core->mtx);
+        while (true) {
+            core->cond.wait(lock, [this] { return !core->draining; });
+            if (core->empty()) {
+                break;
+            }
 
-        std::mutex work_queue_mtx;
-        std::condition_variable work_queue_cond;
-        std::deque<dispatch_que_work_entry> work_queue;
+            core->draining = true;
+            lock.unlock();
+            run_some(this, *core, SIZE_MAX);
+            lock.lock();
+            core->draining = false;
+            core->cond.notify_all();
+        }
+    }
 
-        std::mutex timer_mtx;
-        std::condition_variable timer_cond;
-        std::priority_queue<dispatch_que_work_entry, std::vector<dispatch_que_work_entry>, std::greater<dispatch_que_work_entry> > timers;
+    size_t DispatchQueue::pooled_impl::queue_depth(DispatchQos qos) const {
+        core_lock _(core->mtx);
+        return core->lanes[(size_t) qos].size();
+    }
 
-        std::thread work_queue_thread;
-        std::thread timer_thread;
+    void DispatchQueue::pooled_impl::stats(DispatchQueueStats &out) const {
+        if (dispatch_que_stats *stats = measured.load(std::memory_order_acquire)) {
+            stats->wait.snapshot(out.wait);
+            stats->run.snapshot(out.run);
+        }
+        core_lock _(core->mtx);
+        for (size_t i = 0; i < dispatch_qos_count; ++i) {
+            out.depth[i] = core->lanes[i].size();
+            out.depth_high_water[i] = core->depth_high[i];
+        }
+    }
 
-        std::atomic<bool> quit;
-        std::atomic<bool> work_queue_thread_started;
-        std::atomic<bool> timer_thread_started;
+///////////////////////////////////////////////////////////////////////////
+// DispatchQueue
 
-        using work_queue_lock = std::unique_lock<decltype(work_queue_mtx)>;
-        using timer_lock = std::unique_lock<decltype(timer_mtx)>;
-    };
+    DispatchQueue::DispatchQueue() : m(new serial_impl(ThreadOptions())) {
+        m->anchor->queue = this;
+    }
 
-    void DispatchQueue::impl::dispatch_thread_proc(DispatchQueue::impl *self) {
-        work_queue_lock work_queue_lock(self->work_queue_mtx);
-        self->work_queue_cond.notify_one();
-        self->work_queue_thread_started = true;
+    DispatchQueue::DispatchQueue(int nworkers) : m(new concurrent_impl(nworkers, ThreadOptions())) {
+        m->anchor->queue = this;
+    }
+
+    DispatchQueue::DispatchQueue(DispatchQueueOptions const &options) {
+        if (options.target) {
+            m.reset(new pooled_impl(options.target));
+        } else if (options.concurrent) {
+            m.reset(new concurrent_impl(options.nworkers, options.thread));
+        } else {
+            m.reset(new serial_impl(options.thread));
+        }
+        m->anchor->queue = this;
+    }
 
-        while (self->quit == false) {
-            self->work_queue_cond.wait(work_queue_lock, [&] { return !self->work_queue.empty(); });
+    std::shared_ptr<DispatchQueue> DispatchQueue::concurrent(int nworkers) {
+        return std::make_shared<DispatchQueue>(nworkers);
+    }
 
-            while (!self->work_queue.empty()) {
-                auto work = self->work_queue.back();
-                self->work_queue.pop_back();
+    std::shared_ptr<DispatchQueue> DispatchQueue::create(DispatchQueueOptions const &options) {
+        return std::make_shared<DispatchQueue>(options);
+    }
 
-                work_queue_lock.unlock();
-                work.func();
-                work_queue_lock.lock();
-            }
+    DispatchQueue::~DispatchQueue() {
+        m->shutdown();
+    }
+
+    void DispatchQueue::dispatch_async(Closure func) {
+        submit(std::move(func), DispatchQos::normal, false, nullptr);
+    }
+
+    void DispatchQueue::dispatch_async(DispatchQos qos, Closure func) {
+        submit(std::move(func), qos, false, nullptr);
+    }
+
+    bool DispatchQueue::try_dispatch_async(Closure func) {
+        return submit(std::move(func), DispatchQos::normal, true, nullptr);
+    }
+
+    bool DispatchQueue::try_dispatch_async(DispatchQos qos, Closure func) {
+        return submit(std::move(func), qos, true, nullptr);
+    }
+
+    bool DispatchQueue::submit(Closure func, DispatchQos qos, bool try_only, std::shared_ptr<dispatch_group_state> group) {
+        dispatch_que_work_entry work(std::move(func));
+        work.group = std::move(group);
+        if (m->capacity.load(std::memory_order_relaxed) == 0) {
+            m->dispatch_async(std::move(work), qos);
+            return true;
         }
+        return m->dispatch_bounded(std::move(work), qos, try_only);
     }
 
-    void DispatchQueue::impl::timer_thread_proc(DispatchQueue::impl *self) {
-        timer_lock timer_lock(self->timer_mtx);
-        self->timer_cond.notify_one();
-        self->timer_thread_started = true;
+    void DispatchQueue::dispatch_sync(Closure func) {
+        m->dispatch_sync(std::move(func), DispatchQos::normal);
+    }
 
-        while (self->quit == false) {
-            if (self->timers.empty()) {
-                self->timer_cond.wait(timer_lock, [&] { return self->quit || !self->timers.empty(); });
-            }
+    void DispatchQueue::dispatch_sync(DispatchQos qos, Closure func) {
+        m->dispatch_sync(std::move(func), qos);
+    }
 
-            while (!self->timers.empty()) {
-                auto const &work = self->timers.top();
-                if (self->timer_cond.wait_until(timer_lock, work.expiry, [&] { return self->quit.load(); })) {
-                    break;
-                }
+    void DispatchQueue::dispatch_barrier_async(Closure func) {
+        m->dispatch_barrier(dispatch_que_work_entry(std::move(func)));
+    }
 
-                {
-                    work_queue_lock _(self->work_queue_mtx);
-                    auto where = std::find_if(self->work_queue.rbegin(),
-                                              self->work_queue.rend(),
-                                              [](dispatch_que_work_entry const &w) { return !w.from_timer; });
-                    self->work_queue.insert(where.base(), work);
-                    self->timers.pop();
-                    self->work_queue_cond.notify_one();
-                }
+    DispatchTimer DispatchQueue::dispatch_after(int msec, Closure func) {
+        return dispatch_after(std::chrono::milliseconds(msec), std::move(func));
+    }
+
+    DispatchTimer DispatchQueue::dispatch_after(std::chrono::nanoseconds delay, Closure func) {
+        auto timer = std::make_shared<dispatch_timer_state>();
+        timer->status = dispatch_timer_state::pending;
+        timer->expiry = std::chrono::steady_clock::now() + delay;
+        timer->func = std::move(func);
+        timer->anchor = m->anchor;
+
+        m->dispatch_timer(dispatch_que_work_entry(timer, dispatch_que_work_entry::timer_add));
+        return DispatchTimer(std::move(timer));
+    }
+
+    bool DispatchTimer::cancel() {
+        if (!state_) {
+            return false;
+        }
+
+        int expected = dispatch_timer_state::pending;
+        if (!state_->status.compare_exchange_strong(expected, dispatch_timer_state::cancelled)) {
+            // A repeating timer in the middle of a run: the loop releases the closure once it returned.
+            return expected == dispatch_timer_state::firing &&
+                   state_->status.compare_exchange_strong(expected, dispatch_timer_state::cancelled);
+        }
+        state_->func = nullptr;
+
+        // Ask the owner of the wheel to unlink it, unless the queue is already going away.
+        if (auto anchor = state_->anchor.lock()) {
+            std::unique_lock<std::mutex> _(anchor->mtx);
+            if (anchor->queue != nullptr) {
+                anchor->queue->m->dispatch_timer(dispatch_que_work_entry(state_, dispatch_que_work_entry::timer_cancel));
+            } else if (anchor->main != nullptr) {
+                anchor->main->cancel_timer(state_);
             }
         }
+        return true;
     }
 
-    DispatchQueue::impl::impl()
-            : quit(false), work_queue_thread_started(false), timer_thread_started(false) {
-        work_queue_lock work_queue_lock(work_queue_mtx);
-        timer_lock timer_lock(timer_mtx);
-
-        work_queue_thread = std::thread(dispatch_thread_proc, this);
-        timer_thread = std::thread(timer_thread_proc, this);
+    bool DispatchTimer::pending() const {
+        if (!state_) {
+            return false;
+        }
+        int status = state_->status.load();
+        return status == dispatch_timer_state::pending || status == dispatch_timer_state::firing;
+    }
 
-        work_queue_cond.wait(work_queue_lock, [this] { return work_queue_thread_started.load(); });
-        timer_cond.wait(timer_lock, [this] { return timer_thread_started.load(); });
+    void DispatchQueue::dispatch_flush() {
+        m->dispatch_flush();
     }
 
-    DispatchQueue::DispatchQueue() : m(new impl) {}
+///////////////////////////////////////////////////////////////////////////
+// DispatchGroup
 
-    DispatchQueue::~DispatchQueue() {
-        dispatch_async([this] { m->quit = true; });
-        m->work_queue_thread.join();
+    void dispatch_group_state::leave() {
+        if (count.fetch_sub(1) != 1) {
+            return;
+        }
 
+        std::vector<std::pair<DispatchQueue *, Closure> > ready;
         {
-            impl::timer_lock _(m->timer_mtx);
-            m->timer_cond.notify_one();
+            std::unique_lock<std::mutex> _(mtx);
+            // Somebody may have entered again meanwhile, then the callbacks wait for that work too.
+            if (count.load() == 0) {
+                ready.swap(notify);
+            }
+            cond.notify_all();
         }
 
-        m->timer_thread.join();
+        for (auto &n : ready) {
+            n.first->dispatch_async(std::move(n.second));
+        }
     }
 
-    void DispatchQueue::dispatch_async(std::function<void()> func) {
-        impl::work_queue_lock _(m->work_queue_mtx);
-        m->work_queue.push_front(dispatch_que_work_entry(func));
-        m->work_queue_cond.notify_one();
+    DispatchGroup::DispatchGroup() : state_(std::make_shared<dispatch_group_state>()) {
     }
 
-    void DispatchQueue::dispatch_sync(std::function<void()> func) {
-        std::mutex sync_mtx;
-        impl::work_queue_lock work_queue_lock(sync_mtx);
-        std::condition_variable sync_cond;
-        std::atomic<bool> completed(false);
+    void DispatchGroup::enter() {
+        state_->count.fetch_add(1);
+    }
 
-        {
-            impl::work_queue_lock _(m->work_queue_mtx);
-            m->work_queue.push_front(dispatch_que_work_entry(func));
-            m->work_queue.push_front(dispatch_que_work_entry([&] {
-                std::unique_lock<std::mutex> sync_cb_lock(sync_mtx);
-                completed = true;
-                sync_cond.notify_one();
-            }));
+    void DispatchGroup::leave() {
+        state_->leave();
+    }
 
-            m->work_queue_cond.notify_one();
+    void DispatchGroup::notify(DispatchQueue &queue, Closure func) {
+        {
+            std::unique_lock<std::mutex> _(state_->mtx);
+            if (state_->count.load() != 0) {
+                state_->notify.emplace_back(&queue, std::move(func));
+                return;
+            }
         }
 
-        sync_cond.wait(work_queue_lock, [&] { return completed.load(); });
+        queue.dispatch_async(std::move(func));
+    }
+
+    void DispatchGroup::wait() {
+        std::unique_lock<std::mutex> lock(state_->mtx);
+        state_->cond.wait(lock, [this] { return state_->count.load() == 0; });
+    }
 
+    bool DispatchGroup::wait(std::chrono::nanoseconds timeout) {
+        std::unique_lock<std::mutex> lock(state_->mtx);
+        return state_->cond.wait_for(lock, timeout, [this] { return state_->count.load() == 0; });
     }
 
-    void DispatchQueue::dispatch_after(int msec, std::function<void()> func) {
-        impl::timer_lock _(m->timer_mtx);
-        m->timers.push(
-                dispatch_que_work_entry(func, std::chrono::steady_clock::now() + std::chrono::milliseconds(msec)));
-        m->timer_cond.notify_one();
+    void DispatchGroup::dispatch_async(DispatchQueue &queue, Closure func) {
+        dispatch_async(queue, DispatchQos::normal, std::move(func));
     }
 
-    void DispatchQueue::dispatch_flush() {
-        dispatch_sync([] {});
+    // The group rides along in the entry, wrapping func in another closure would not fit inline.
+    // A task shed by a bounded queue still leaves.
+    void DispatchGroup::dispatch_async(DispatchQueue &queue, DispatchQos qos, Closure func) {
+        enter();
+        queue.submit(std::move(func), qos, false, state_);
+    }
+
+    void DispatchQueue::set_max_batch(size_t max_batch) {
+        m->set_max_batch(max_batch);
+    }
+
+    void DispatchQueue::set_capacity(size_t capacity, DispatchOverflow policy) {
+        m->overflow_policy = policy;
+        m->capacity = capacity;
+    }
+
+    size_t DispatchQueue::queue_depth(DispatchQos qos) const {
+        return m->queue_depth(qos);
+    }
+
+    void DispatchQueue::set_stats_enabled(bool enabled) {
+        m->stats_enabled = enabled;
+    }
+
+    DispatchQueueStats DispatchQueue::stats() const {
+        DispatchQueueStats out;
+        m->stats(out);
+        out.rejected = m->rejected.load(std::memory_order_relaxed);
+        out.dropped = m->dropped.load(std::memory_order_relaxed);
+        return out;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// dispatch_apply
+
+    // One participant's share of a dispatch_apply, begin in the high and end in the low half of range.
+    // The owner claims chunks off the front and a participant that ran dry cuts off the back half,
+    // so a range is only split once somebody needs the work (lazy binary splitting).
+    struct dispatch_apply_slot {
+        std::atomic<uint64_t> range{0};
+        // A cache line each.
+        char pad[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    // Shared by the caller and its helper tasks. A helper that only starts once everything is done
+    // finds nothing to claim and never touches fn, which lives on the caller's stack.
+    struct dispatch_apply_state {
+        dispatch_apply_state(std::function<void(size_t, size_t)> const &fn_, size_t offset_, size_t n,
+                             size_t grain_, size_t participants)
+                : fn(fn_), offset(offset_), grain(grain_), slots(participants), remaining(n), next_slot(1) {
+            slots[0].range.store(pack(0, n), std::memory_order_relaxed);
+        }
+
+        static uint64_t pack(size_t begin, size_t end) {
+            return ((uint64_t) begin << 32) | (uint64_t) end;
+        }
+
+        static size_t begin_of(uint64_t range) {
+            return (size_t) (range >> 32);
+        }
+
+        static size_t end_of(uint64_t range) {
+            return (size_t) (range & 0xffffffffu);
+        }
+
+        // Big chunks while plenty is left, down to grain toward the end; never leaves less than grain behind.
+        bool claim(size_t self, size_t &begin, size_t &end) {
+            auto &range = slots[self].range;
+            uint64_t r = range.load(std::memory_order_acquire);
+            while (true) {
+                size_t b = begin_of(r), e = end_of(r);
+                if (b >= e) {
+                    return false;
+                }
+                size_t c = std::min(e, b + std::max(grain, (e - b) / (2 * slots.size())));
+                if (e - c < grain) {
+                    c = e;
+                }
+                if (range.compare_exchange_weak(r, pack(c, e), std::memory_order_acq_rel)) {
+                    begin = b;
+                    end = c;
+                    return true;
+                }
+            }
+        }
+
+        bool steal(size_t self) {
+            size_t p = slots.size();
+            for (size_t i = 1; i < p; ++i) {
+                auto &victim = slots[(self + i) % p].range;
+                uint64_t r = victim.load(std::memory_order_acquire);
+                while (begin_of(r) < end_of(r) && end_of(r) - begin_of(r) >= 2 * grain) {
+                    size_t b = begin_of(r), e = end_of(r), mid = b + (e - b) / 2;
+                    if (victim.compare_exchange_weak(r, pack(b, mid), std::memory_order_acq_rel)) {
+                        // Nobody takes from an empty slot, so a plain store will do.
+                        slots[self].range.store(pack(mid, e), std::memory_order_release);
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        void participate(size_t self) {
+            size_t begin, end;
+            do {
+                while (claim(self, begin, end)) {
+                    fn(offset + begin, offset + end);
+                    if (remaining.fetch_sub(end - begin, std::memory_order_acq_rel) == end - begin) {
+                        done.signal();
+                    }
+                }
+            } while (steal(self));
+        }
+
+        std::function<void(size_t, size_t)> const &fn;
+        size_t offset;
+        size_t grain;
+        std::vector<dispatch_apply_slot> slots;
+        std::atomic<size_t> remaining;
+        std::atomic<size_t> next_slot;
+        sync_completion done;
+    };
+
+    // Ranges are packed in 32 bits a side, a larger n goes in blocks.
+    void DispatchQueue::dispatch_apply_range(size_t n, std::function<void(size_t, size_t)> const &fn, size_t grain) {
+        const size_t block = 0xffffffffu;
+        grain = std::max<size_t>(grain, 1);
+        for (size_t offset = 0; offset < n; offset += block) {
+            size_t count = std::min(block, n - offset);
+            size_t helpers = std::min(m->concurrency(), (count - 1) / grain);
+            if (helpers == 0) {
+                fn(offset, offset + count);
+                continue;
+            }
+
+            auto state = std::make_shared<dispatch_apply_state>(fn, offset, count, grain, helpers + 1);
+            for (size_t i = 0; i < helpers; ++i) {
+                m->dispatch_async(dispatch_que_work_entry([state] {
+                    size_t self = state->next_slot.fetch_add(1);
+                    if (self < state->slots.size()) {
+                        state->participate(self);
+                    }
+                }), DispatchQos::normal);
+            }
+
+            state->participate(0);
+            if (state->remaining.load(std::memory_order_acquire) != 0) {
+                state->done.wait();
+            }
+        }
     }
 
 ///////////////////////////////////////////////////////////////////////////
 // DispatchQueueMain
 
+    // An fd watched by a DispatchQueueMain. gen tells a stale event of a removed fd from the one
+    // that took its number since.
+    struct dispatch_fd_source {
+        int fd;
+        uint32_t gen;
+        std::function<void(uint32_t)> callback;
+    };
+
     struct DispatchQueueMain::impl {
         impl();
 
+        ~impl();
+
+        // Queues an entry from any thread and wakes the loop if it is waiting.
+        void post(dispatch_que_work_entry work);
+
+        // Gets the loop out of wait_events, if it is in there.
+        void wake();
+
+        // Waits for a posted task, a ready fd or deadline when block is set, else only looks.
+        // Runs the fd callbacks and returns how many ran.
+        size_t wait_events(bool block, time_point deadline);
+
+        // Loop thread only.
+        void run_entry(dispatch_que_work_entry &work);
+
+        void fire(std::shared_ptr<dispatch_timer_state> timer);
+
+        bool run_idle();
+
         std::mutex work_queue_mtx_;
         std::condition_variable work_queue_cond_;
         std::deque<dispatch_que_work_entry> work_queue_;
+        // Run one per loop round when nothing else is going on.
+        std::deque<Closure> idle_;
+        // Under work_queue_mtx_: the loop is about to block, the next post has to wake it.
+        bool waiting_;
+
+        // Loop thread only, fed by timer_add and timer_cancel entries through work_queue_.
+        dispatch_timers timers_;
+        dispatch_que_batch due_;
+        std::shared_ptr<dispatch_timer_anchor> anchor_;
 
         std::atomic<bool> stopped_;
         std::atomic<bool> work_queue_started_;
+        std::atomic<size_t> max_batch_;
+
+#if defined(__linux__)
+        // Posted tasks, fd readiness and the next deadline wake the same epoll_wait, event_fd_ being
+        // the doorbell and timer_fd_ armed for the deadline of a blocking wait.
+        int epoll_fd_;
+        int event_fd_;
+        int timer_fd_;
+        time_point armed_;
+        std::mutex sources_mtx_;
+        std::unordered_map<int, std::shared_ptr<dispatch_fd_source> > sources_;
+        uint32_t next_gen_;
+#endif
+
+        // The main queue whose loop runs on this thread, if any.
+        static thread_local impl *current_loop;
 
         using work_queue_lock = std::unique_lock<decltype(work_queue_mtx_)>;
     };
 
-    DispatchQueueMain::impl::impl():stopped_(false), work_queue_started_(false) {
+    thread_local DispatchQueueMain::impl *DispatchQueueMain::impl::current_loop = nullptr;
+
+#if defined(__linux__)
+    // epoll data of event_fd_ and timer_fd_, fd sources have a gen of at least 1 in the high half.
+    static const uint64_t dispatch_wake_key = 0;
+    static const uint64_t dispatch_timer_key = 1;
+
+    DispatchQueueMain::impl::impl()
+            : waiting_(false), anchor_(std::make_shared<dispatch_timer_anchor>()), stopped_(false),
+              work_queue_started_(false), max_batch_(0), armed_(time_point::max()), next_gen_(0) {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        OSU_RETURN_EXP_IF_FAIL(epoll_fd_ >= 0 && event_fd_ >= 0 && timer_fd_ >= 0, return);
+
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = dispatch_wake_key;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev);
+        ev.data.u64 = dispatch_timer_key;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &ev);
+    }
+
+    DispatchQueueMain::impl::~impl() {
+        if (timer_fd_ >= 0) close(timer_fd_);
+        if (event_fd_ >= 0) close(event_fd_);
+        if (epoll_fd_ >= 0) close(epoll_fd_);
+    }
+
+    void DispatchQueueMain::impl::wake() {
+        uint64_t one = 1;
+        ssize_t n = write(event_fd_, &one, sizeof(one));
+        (void) n;
+    }
+
+    static uint32_t dispatch_fd_to_epoll(uint32_t events) {
+        uint32_t ev = 0;
+        if (events & dispatch_fd_readable) ev |= EPOLLIN | EPOLLRDHUP;
+        if (events & dispatch_fd_writable) ev |= EPOLLOUT;
+        return ev;
+    }
+
+    static uint32_t dispatch_fd_from_epoll(uint32_t ev) {
+        uint32_t events = 0;
+        if (ev & (EPOLLIN | EPOLLRDHUP)) events |= dispatch_fd_readable;
+        if (ev & EPOLLOUT) events |= dispatch_fd_writable;
+        if (ev & (EPOLLERR | EPOLLHUP)) events |= dispatch_fd_error;
+        return events;
+    }
+
+    size_t DispatchQueueMain::impl::wait_events(bool block, time_point deadline) {
+        // Absolute and in nanoseconds, steady_clock being CLOCK_MONOTONIC. Only re-armed when the deadline moved.
+        if (block && deadline != armed_) {
+            itimerspec spec;
+            memset(&spec, 0, sizeof(spec));
+            if (deadline != time_point::max()) {
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+                // All zero would disarm it instead.
+                ns = std::max<int64_t>(ns, 1);
+                spec.it_value.tv_sec = ns / 1000000000;
+                spec.it_value.tv_nsec = ns % 1000000000;
+            }
+            timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+            armed_ = deadline;
+        }
+
+        epoll_event events[64];
+        int n = epoll_wait(epoll_fd_, events, 64, block ? -1 : 0);
+        if (block) {
+            work_queue_lock _(work_queue_mtx_);
+            waiting_ = false;
+        }
+
+        size_t ran = 0;
+        for (int i = 0; i < n; ++i) {
+            uint64_t key = events[i].data.u64;
+            if (key == dispatch_wake_key || key == dispatch_timer_key) {
+                uint64_t count;
+                ssize_t r = read(key == dispatch_wake_key ? event_fd_ : timer_fd_, &count, sizeof(count));
+                (void) r;
+                if (key == dispatch_timer_key) {
+                    armed_ = time_point::max();
+                }
+                continue;
+            }
+
+            // A callback earlier in this round may have removed the fd, or even reused its number.
+            std::shared_ptr<dispatch_fd_source> source;
+            {
+                std::unique_lock<std::mutex> _(sources_mtx_);
+                auto it = sources_.find((int) (uint32_t) key);
+                if (it != sources_.end() && it->second->gen == (uint32_t) (key >> 32)) {
+                    source = it->second;
+                }
+            }
+            if (source) {
+                source->callback(dispatch_fd_from_epoll(events[i].events));
+                ran++;
+            }
+        }
+        return ran;
+    }
+#else
+    DispatchQueueMain::impl::impl()
+            : waiting_(false), anchor_(std::make_shared<dispatch_timer_anchor>()), stopped_(false),
+              work_queue_started_(false), max_batch_(0) {
+    }
+
+    DispatchQueueMain::impl::~impl() {
+    }
+
+    void DispatchQueueMain::impl::wake() {
+        work_queue_lock _(work_queue_mtx_);
+        work_queue_cond_.notify_one();
+    }
+
+    size_t DispatchQueueMain::impl::wait_events(bool block, time_point deadline) {
+        work_queue_lock lock(work_queue_mtx_);
+        if (block) {
+            auto ready = [this] { return !work_queue_.empty() || !idle_.empty(); };
+            if (deadline == time_point::max()) {
+                work_queue_cond_.wait(lock, ready);
+            } else {
+                work_queue_cond_.wait_until(lock, deadline, ready);
+            }
+            waiting_ = false;
+        }
+        return 0;
+    }
+#endif
+
+    void DispatchQueueMain::impl::post(dispatch_que_work_entry work) {
+        bool wake_loop;
+        {
+            work_queue_lock _(work_queue_mtx_);
+            work_queue_.push_front(std::move(work));
+            wake_loop = waiting_;
+            waiting_ = false;
+        }
+        if (wake_loop) {
+            wake();
+        }
+    }
+
+    void DispatchQueueMain::impl::run_entry(dispatch_que_work_entry &work) {
+        switch (work.kind) {
+            case dispatch_que_work_entry::timer_add:
+            case dispatch_que_work_entry::timer_cancel:
+                timers_.apply(work);
+                break;
+            case dispatch_que_work_entry::timer_fire:
+                fire(std::move(work.timer));
+                break;
+            default:
+                run_task(work);
+        }
+    }
+
+    // Runs a due repeating timer and files it again one interval after the deadline it was due at,
+    // so it does not drift. Deadlines already past are skipped rather than fired in a burst.
+    void DispatchQueueMain::impl::fire(std::shared_ptr<dispatch_timer_state> timer) {
+        timer->func();
+
+        int expected = dispatch_timer_state::firing;
+        if (!timer->status.compare_exchange_strong(expected, dispatch_timer_state::pending)) {
+            // Cancelled while it ran.
+            timer->func = nullptr;
+            return;
+        }
+
+        timer->expiry += timer->interval;
+        time_point now = std::chrono::steady_clock::now();
+        if (timer->expiry <= now) {
+            timer->expiry += timer->interval * ((now - timer->expiry) / timer->interval + 1);
+        }
+        timers_.add(std::move(timer));
+    }
 
+    // One idle callback, unless tasks arrived meanwhile. False if there was none to run.
+    bool DispatchQueueMain::impl::run_idle() {
+        Closure func;
+        {
+            work_queue_lock _(work_queue_mtx_);
+            if (idle_.empty() || !work_queue_.empty()) {
+                return false;
+            }
+            func = std::move(idle_.front());
+            idle_.pop_front();
+        }
+        func();
+        return true;
     }
 
     DispatchQueueMain::DispatchQueueMain():m(new impl){
-        //TODO
+        m->anchor_->main = this;
     }
 
     DispatchQueueMain::~DispatchQueueMain() {
+        {
+            std::unique_lock<std::mutex> _(m->anchor_->mtx);
+            m->anchor_->main = nullptr;
+        }
         stop();
     }
 
 
     // Run Task in main thread
-    void DispatchQueueMain::dispatch_sync(const std::function<void(void)> &task) {
+    void DispatchQueueMain::dispatch_sync(Closure task) {
+        // Called from inside the loop, run it right here rather than wait for ourselves.
+        if (impl::current_loop == m.get()) {
+            task();
+            return;
+        }
 
-        std::mutex sync_mtx;
-        impl::work_queue_lock wlock(sync_mtx);
-        std::condition_variable sync_cond;
-        std::atomic<bool> completed(false);
-        {
-            impl::work_queue_lock _(m->work_queue_mtx_);
-            m->work_queue_.push_front(dispatch_que_work_entry(task));
-            m->work_queue_.push_front(dispatch_que_work_entry([&] {
-                std::unique_lock<std::mutex> sync_cb_lock(sync_mtx);
-                completed = true;
-                sync_cond.notify_one();
-            }));
+        sync_completion &completion = sync_completion::local();
+        completion.reset();
+        dispatch_async([&task, &completion] {
+            task();
+            completion.signal();
+        });
+        completion.wait();
+    }
 
-            m->work_queue_cond_.notify_one();
-        }
+    void DispatchQueueMain::dispatch_async(Closure task) {
+        m->post(dispatch_que_work_entry(std::move(task)));
+    }
+
+    DispatchTimer DispatchQueueMain::dispatch_after(int msec, Closure func) {
+        return dispatch_after(std::chrono::milliseconds(msec), std::move(func));
+    }
+
+    DispatchTimer DispatchQueueMain::dispatch_after(std::chrono::nanoseconds delay, Closure func) {
+        return dispatch_timer(delay, std::chrono::nanoseconds(0), std::move(func));
+    }
 
-        sync_cond.wait(wlock, [&] { return completed.load();});
+    DispatchTimer DispatchQueueMain::dispatch_repeating(std::chrono::nanoseconds interval, Closure func) {
+        OSU_RETURN_EXP_IF_FAIL(interval.count() > 0, return DispatchTimer());
+        return dispatch_timer(interval, interval, std::move(func));
     }
 
-    void DispatchQueueMain::dispatch_async(const std::function<void(void)> &task) {
-        impl::work_queue_lock _(m->work_queue_mtx_);
-        m->work_queue_.push_front(dispatch_que_work_entry(task));
-        m->work_queue_cond_.notify_one();
+    DispatchTimer DispatchQueueMain::dispatch_timer(std::chrono::nanoseconds delay, std::chrono::nanoseconds interval,
+                                                    Closure func) {
+        auto timer = std::make_shared<dispatch_timer_state>();
+        timer->status = dispatch_timer_state::pending;
+        timer->expiry = std::chrono::steady_clock::now() + delay;
+        timer->interval = interval;
+        timer->func = std::move(func);
+        timer->anchor = m->anchor_;
+
+        m->post(dispatch_que_work_entry(timer, dispatch_que_work_entry::timer_add));
+        return DispatchTimer(std::move(timer));
+    }
+
+    void DispatchQueueMain::cancel_timer(std::shared_ptr<dispatch_timer_state> timer) {
+        m->post(dispatch_que_work_entry(std::move(timer), dispatch_que_work_entry::timer_cancel));
+    }
+
+    void DispatchQueueMain::dispatch_idle(Closure func) {
+        bool wake;
+        {
+            impl::work_queue_lock _(m->work_queue_mtx_);
+            m->idle_.push_back(std::move(func));
+            wake = m->waiting_;
+            m->waiting_ = false;
+        }
+        if (wake) {
+            m->wake();
+        }
     }
 
-    // Run loop in main thread.
+    // Run loop in main thread. Every round runs a batch of tasks, then the timers due, then the fds
+    // that are ready; an idle callback only gets a round in which none of them had anything.
     void DispatchQueueMain::runMainLoop()
     {
-        impl::work_queue_lock wlock(m->work_queue_mtx_);
-        m->work_queue_cond_.notify_one();
-        m->work_queue_started_ = true;
+        impl *self = m.get();
+        self->work_queue_started_ = true;
+        impl::current_loop = self;
+
+        dispatch_que_batch batch;
+        while (!self->stopped_) {
+            {
+                impl::work_queue_lock _(self->work_queue_mtx_);
+                take_batch(self->work_queue_, batch, batch_limit(self->max_batch_));
+            }
+            bool busy = !batch.empty();
+            while (!batch.empty()) {
+                self->run_entry(batch.back());
+                batch.pop_back();
+            }
+
+            if (!self->timers_.empty() && !self->stopped_) {
+                self->timers_.expire(std::chrono::steady_clock::now(), self->due_, nullptr);
+                busy |= !self->due_.empty();
+                while (!self->due_.empty()) {
+                    self->run_entry(self->due_.back());
+                    self->due_.pop_back();
+                }
+            }
+            if (self->stopped_) {
+                break;
+            }
 
-        while(!m->stopped_) {
-            m->work_queue_cond_.wait(wlock, [&]{ return !m->work_queue_.empty();});
-            while(!m->work_queue_.empty()) {
-                auto work = m->work_queue_.back();
-                m->work_queue_.pop_back();
-                wlock.unlock();
-                work.func();
-                wlock.lock();
+            bool block;
+            {
+                impl::work_queue_lock _(self->work_queue_mtx_);
+                block = !busy && self->work_queue_.empty() && self->idle_.empty();
+                self->waiting_ = block;
             }
+
+            // Ready fds get their turn between batches even while tasks keep coming.
+            if (self->wait_events(block, self->timers_.next_wakeup()) == 0 && !busy && !block) {
+                self->run_idle();
+            }
+        }
+
+        impl::current_loop = nullptr;
+    }
+
+    void DispatchQueueMain::set_max_batch(size_t max_batch) {
+        m->max_batch_ = max_batch;
+    }
+
+#if defined(__linux__)
+    int DispatchQueueMain::add_fd(int fd, uint32_t events, std::function<void(uint32_t)> callback) {
+        std::unique_lock<std::mutex> _(m->sources_mtx_);
+        if (m->sources_.count(fd) != 0) {
+            errno = EEXIST;
+            return -1;
         }
+
+        auto source = std::make_shared<dispatch_fd_source>();
+        source->fd = fd;
+        if (++m->next_gen_ == dispatch_wake_key) {
+            ++m->next_gen_;
+        }
+        source->gen = m->next_gen_;
+        source->callback = std::move(callback);
+
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = dispatch_fd_to_epoll(events);
+        ev.data.u64 = ((uint64_t) source->gen << 32) | (uint32_t) fd;
+        if (epoll_ctl(m->epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            return -1;
+        }
+        m->sources_[fd] = std::move(source);
+        return 0;
+    }
+
+    int DispatchQueueMain::update_fd(int fd, uint32_t events) {
+        std::unique_lock<std::mutex> _(m->sources_mtx_);
+        auto it = m->sources_.find(fd);
+        if (it == m->sources_.end()) {
+            errno = ENOENT;
+            return -1;
+        }
+
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = dispatch_fd_to_epoll(events);
+        ev.data.u64 = ((uint64_t) it->second->gen << 32) | (uint32_t) fd;
+        return epoll_ctl(m->epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+    }
+
+    int DispatchQueueMain::remove_fd(int fd) {
+        std::unique_lock<std::mutex> _(m->sources_mtx_);
+        auto it = m->sources_.find(fd);
+        if (it == m->sources_.end()) {
+            errno = ENOENT;
+            return -1;
+        }
+        m->sources_.erase(it);
+        return epoll_ctl(m->epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    }
+#else
+    int DispatchQueueMain::add_fd(int, uint32_t, std::function<void(uint32_t)>) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    int DispatchQueueMain::update_fd(int, uint32_t) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    int DispatchQueueMain::remove_fd(int) {
+        errno = ENOSYS;
+        return -1;
     }
+#endif
 
     void DispatchQueueMain::stop() {
         dispatch_async([this]{
@@ -9,22 +9,226 @@
 #include <queue>
 #include <deque>
 #include <thread>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <stdint.h>
+#include "osu_closure.h"
+#include "osu_histogram.h"
+#include "osu_thread.h"
 
 namespace osu {
+    // Priority class of a task. Every queue keeps one lane per class and serves the higher ones first;
+    // a lane passed over too many times in a row gets a turn anyway, so background work slows down but never starves.
+    enum class DispatchQos : uint8_t {
+        interactive, normal, background
+    };
+
+    const size_t dispatch_qos_count = 3;
+
+    // What dispatch_async does when a bounded queue is full.
+    enum class DispatchOverflow : uint8_t {
+        // Wait for room.
+        block,
+        // Drop the new task, counted as rejected.
+        reject,
+        // Make room by dropping the oldest task of the lowest non-empty lane, counted as dropped.
+        drop_oldest
+    };
+
+    // What a queue measured since set_stats_enabled(true). Times are in nanoseconds, arrays are indexed by DispatchQos.
+    struct DispatchQueueStats {
+        // From dispatch_async (or a timer firing) to the task starting.
+        HistogramSnapshot wait;
+        HistogramSnapshot run;
+        // From a dispatch_after expiry to the worker firing it.
+        HistogramSnapshot timer_lateness;
+        size_t depth[dispatch_qos_count];
+        size_t depth_high_water[dispatch_qos_count];
+        // Load shed by a bounded queue, counted whether or not stats are enabled.
+        uint64_t rejected;
+        uint64_t dropped;
+    };
+
+    class DispatchQueue;
+
+    // How a DispatchQueue is built.
+    struct DispatchQueueOptions {
+        // Serial unless set, then nworkers threads, nworkers <= 0 meaning one per core.
+        bool concurrent = false;
+        int nworkers = 0;
+        // A serial queue without threads of its own, its tasks take turns on target's threads instead
+        // (typically a concurrent queue shared by many). It keeps FIFO order and runs one task at a time,
+        // costs a few hundred bytes and no thread while idle. Keeps target alive; the fields above are ignored.
+        std::shared_ptr<DispatchQueue> target;
+        // Applied to every thread of the queue.
+        ThreadOptions thread;
+    };
+
+    struct dispatch_timer_state;
+    struct dispatch_group_state;
+
+    // Handle to a task armed with dispatch_after. Copies refer to the same timer.
+    class DispatchTimer {
+    public:
+        DispatchTimer() {}
+
+        // Stops the task from running and releases its closure right away. Returns false when
+        // it already fired or was cancelled before.
+        bool cancel();
+
+        // True while the task is still waiting for its deadline.
+        bool pending() const;
+
+    private:
+        friend class DispatchQueue;
+        friend class DispatchQueueMain;
+
+        explicit DispatchTimer(std::shared_ptr<dispatch_timer_state> state) : state_(std::move(state)) {}
+
+        std::shared_ptr<dispatch_timer_state> state_;
+    };
+
+    // Counts outstanding work, possibly spread over several queues, so the caller can block until
+    // it is all done or have a callback queued when it is. Copies refer to the same group.
+    class DispatchGroup {
+    public:
+        DispatchGroup();
+
+        void enter();
+
+        void leave();
+
+        // Runs func on queue once the group is empty, straight away if it is empty now. The queue
+        // must outlive the group's pending work.
+        void notify(DispatchQueue &queue, Closure func);
+
+        void wait();
+
+        // False if the group was still busy after timeout.
+        bool wait(std::chrono::nanoseconds timeout);
+
+        // dispatch_async on queue with an enter now and a leave once func returned.
+        void dispatch_async(DispatchQueue &queue, Closure func);
+
+        void dispatch_async(DispatchQueue &queue, DispatchQos qos, Closure func);
+
+    private:
+        std::shared_ptr<dispatch_group_state> state_;
+    };
+
     class DispatchQueue {
     public:
+        // Serial queue, tasks run one by one in FIFO order on a single thread.
         DispatchQueue();
 
+        // Concurrent queue, tasks run on nworkers threads. Every worker owns a local deque
+        // and steals from the others when it runs dry. nworkers <= 0 means one per core.
+        explicit DispatchQueue(int nworkers);
+
+        explicit DispatchQueue(DispatchQueueOptions const &options);
+
+        static std::shared_ptr<DispatchQueue> concurrent(int nworkers = 0);
+
+        static std::shared_ptr<DispatchQueue> create(DispatchQueueOptions const &options);
+
         ~DispatchQueue();
 
-        void dispatch_async(std::function<void()> func);
+        void dispatch_async(Closure func);
+
+        void dispatch_async(DispatchQos qos, Closure func);
+
+        // Never blocks: on a full bounded queue the task is rejected and false returned, whatever the policy.
+        bool try_dispatch_async(Closure func);
+
+        bool try_dispatch_async(DispatchQos qos, Closure func);
+
+        // Blocks until func has run on the queue. Called from a task of this queue, func runs inline.
+        void dispatch_sync(Closure func);
+
+        void dispatch_sync(DispatchQos qos, Closure func);
+
+        // On a concurrent queue func waits for everything submitted before it, runs alone, and holds
+        // back everything submitted after it until it returned. On a serial queue it is dispatch_async.
+        void dispatch_barrier_async(Closure func);
 
-        void dispatch_sync(std::function<void()> func);
+        DispatchTimer dispatch_after(int msec, Closure func);
 
-        void dispatch_after(int msec, std::function<void()> func);
+        DispatchTimer dispatch_after(std::chrono::nanoseconds delay, Closure func);
 
         void dispatch_flush();
 
+        // Calls fn(i) for every i in [0, n) on this queue's workers, the calling thread taking part,
+        // and returns once all calls returned. fn is called concurrently on a concurrent queue.
+        template<typename F>
+        void dispatch_apply(size_t n, F &&fn) {
+            dispatch_apply_range(n, [&fn](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    fn(i);
+                }
+            });
+        }
+
+        // dispatch_apply by the range: fn(begin, end) for disjoint ranges covering [0, n), none shorter
+        // than grain but the last. Ranges start out large and are only cut when a participant runs dry.
+        void dispatch_apply_range(size_t n, std::function<void(size_t, size_t)> const &fn, size_t grain = 1);
+
+        // Most tasks the worker runs per visit to the queue before it looks at expired timers again.
+        // 0 (the default) takes everything pending; a small value bounds head-of-line blocking.
+        void set_max_batch(size_t max_batch);
+
+        // Bounds the tasks waiting in the queue, 0 (the default) means unbounded; set it before use.
+        // Only dispatch_async and try_dispatch_async count: dispatch_sync, timers and barriers always
+        // get in, and a task of the queue itself goes over rather than blocking on itself.
+        // A shed task is destroyed without running: a DispatchFuture it was to complete breaks with
+        // broken_promise, but don't shed coroutine resumptions (schedule()).
+        void set_capacity(size_t capacity, DispatchOverflow policy = DispatchOverflow::block);
+
+        // Tasks waiting in the lane of qos, a snapshot safe to read from any thread.
+        size_t queue_depth(DispatchQos qos) const;
+
+        // Off by default. While on, every task costs two clock reads and a few relaxed stores,
+        // every worker writing its own histograms.
+        void set_stats_enabled(bool enabled);
+
+        // Read while the queue keeps running, so the numbers are only consistent with each other approximately.
+        DispatchQueueStats stats() const;
+
+        // Handle is a std::coroutine_handle. It fits a Closure inline, so resuming allocates nothing.
+        struct resume_awaiter {
+            DispatchQueue *queue;
+            DispatchQos qos;
+
+            bool await_ready() const noexcept { return false; }
+
+            template<typename Handle>
+            void await_suspend(Handle h) { queue->dispatch_async(qos, h); }
+
+            void await_resume() const noexcept {}
+        };
+
+        struct delay_awaiter {
+            DispatchQueue *queue;
+            std::chrono::nanoseconds delay;
+
+            bool await_ready() const noexcept { return false; }
+
+            template<typename Handle>
+            void await_suspend(Handle h) { queue->dispatch_after(delay, h); }
+
+            void await_resume() const noexcept {}
+        };
+
+        // For C++20 coroutines, see osu_dispatch_task.h: co_await queue.schedule() carries on as a task
+        // of this queue, co_await queue.after(5ms) does the same once the delay has passed.
+        resume_awaiter schedule(DispatchQos qos = DispatchQos::normal) { return {this, qos}; }
+
+        delay_awaiter after(std::chrono::nanoseconds delay) { return {this, delay}; }
+
         // Disable Copy and == operations.
         DispatchQueue(DispatchQueue const &) = delete;
 
@@ -32,10 +236,27 @@ namespace osu {
 
 
     private:
+        friend class DispatchTimer;
+        friend class DispatchGroup;
+
+        // Every public submission goes through here, bounded or not. False when the task was rejected.
+        bool submit(Closure func, DispatchQos qos, bool try_only, std::shared_ptr<dispatch_group_state> group);
+
         struct impl;
+        struct serial_impl;
+        struct concurrent_impl;
+        struct pooled_impl;
         std::unique_ptr <impl> m;
     };
 
+    using DispatchQueuePtr = std::shared_ptr<DispatchQueue>;
+
+
+    // Readiness of an fd watched by DispatchQueueMain, combined into a mask.
+    const uint32_t dispatch_fd_readable = 1;
+    const uint32_t dispatch_fd_writable = 2;
+    // Error or hangup, reported whether asked for or not.
+    const uint32_t dispatch_fd_error = 4;
 
     class DispatchQueueMain {
     public:
@@ -43,15 +264,71 @@ namespace osu {
 
         virtual ~DispatchQueueMain();
 
-        // Run task in main thread
-        void dispatch_sync(const std::function<void(void)> &task);
+        // Run task in main thread, inline when called from the main loop itself.
+        void dispatch_sync(Closure task);
 
         // Run task asynchronous
-        void dispatch_async(const std::function<void(void)> &task);
+        void dispatch_async(Closure task);
+
+        // Runs func in the main loop once delay has passed. The loop sleeps right until the next deadline.
+        DispatchTimer dispatch_after(int msec, Closure func);
+
+        DispatchTimer dispatch_after(std::chrono::nanoseconds delay, Closure func);
+
+        // Runs func every interval, the first time one interval from now, until the timer is cancelled.
+        // Deadlines stay on the interval grid; one missed altogether is skipped, not made up for.
+        DispatchTimer dispatch_repeating(std::chrono::nanoseconds interval, Closure func);
+
+        // Runs func once the loop has nothing else to do: no task queued, no timer due, no fd ready.
+        // One per loop round; a callback that posts itself again keeps the loop spinning while idle.
+        void dispatch_idle(Closure func);
 
         // Run loop in main thread.
         void runMainLoop();
 
+        // Most tasks runMainLoop takes per lock, 0 (the default) takes everything pending.
+        void set_max_batch(size_t max_batch);
+
+        // Calls callback(ready) in the main loop while fd is ready for any of events, a mask of
+        // dispatch_fd_*. Level-triggered: read or write until EAGAIN, or the callback comes right back.
+        // Returns 0, or -1 with errno set: EEXIST if fd is watched already, ENOSYS without epoll (non-Linux).
+        int add_fd(int fd, uint32_t events, std::function<void(uint32_t)> callback);
+
+        // Changes what fd is watched for, 0 leaves only dispatch_fd_error.
+        int update_fd(int fd, uint32_t events);
+
+        // Stops watching fd, call it before closing fd. From the main loop the callback is not called
+        // again once it returns; from another thread a call already under way may still finish.
+        int remove_fd(int fd);
+
+        struct resume_awaiter {
+            DispatchQueueMain *queue;
+
+            bool await_ready() const noexcept { return false; }
+
+            template<typename Handle>
+            void await_suspend(Handle h) { queue->dispatch_async(h); }
+
+            void await_resume() const noexcept {}
+        };
+
+        struct delay_awaiter {
+            DispatchQueueMain *queue;
+            std::chrono::nanoseconds delay;
+
+            bool await_ready() const noexcept { return false; }
+
+            template<typename Handle>
+            void await_suspend(Handle h) { queue->dispatch_after(delay, h); }
+
+            void await_resume() const noexcept {}
+        };
+
+        // co_await main.schedule() carries on in the main loop, co_await main.after(5ms) does once the delay passed.
+        resume_awaiter schedule() { return {this}; }
+
+        delay_awaiter after(std::chrono::nanoseconds delay) { return {this, delay}; }
+
         void stop();
 
         // Disable Copy and == operations.
@@ -60,6 +337,13 @@ namespace osu {
         DispatchQueueMain &operator=(DispatchQueueMain const &) = delete;
 
     private:
+        friend class DispatchTimer;
+
+        DispatchTimer dispatch_timer(std::chrono::nanoseconds delay, std::chrono::nanoseconds interval, Closure func);
+
+        // Unlinks a cancelled timer, on behalf of DispatchTimer::cancel.
+        void cancel_timer(std::shared_ptr<dispatch_timer_state> timer);
+
         struct impl;
         std::unique_ptr <impl> m;
     };
@@ -0,0 +1,189 @@
+#include "osu.h"
+#include <deque>
+#include <algorithm>
+
+// The submission path DispatchQueue used before the lock-free ring: every post takes the mutex,
+// pushes onto a deque and signals the condition variable.
+class LockedQueue {
+public:
+    LockedQueue() : quit_(false) {
+        worker_ = std::thread([this] {
+            std::unique_lock<std::mutex> lock(mtx_);
+            while (!quit_) {
+                cond_.wait(lock, [this] { return !queue_.empty(); });
+                while (!queue_.empty()) {
+                    auto work = queue_.back();
+                    queue_.pop_back();
+                    lock.unlock();
+                    work();
+                    lock.lock();
+                }
+            }
+        });
+    }
+
+    ~LockedQueue() {
+        dispatch_async([this] { quit_ = true; });
+        worker_.join();
+    }
+
+    void dispatch_async(std::function<void()> func) {
+        std::unique_lock<std::mutex> _(mtx_);
+        queue_.push_front(std::move(func));
+        cond_.notify_one();
+    }
+
+    void dispatch_flush() {
+        std::atomic<bool> done(false);
+        dispatch_async([&] { done = true; });
+        while (!done) std::this_thread::yield();
+    }
+
+private:
+    std::mutex mtx_;
+    std::condition_variable cond_;
+    std::deque<std::function<void()>> queue_;
+    std::thread worker_;
+    std::atomic<bool> quit_;
+};
+
+template<typename Queue>
+static void run(const char *name, Queue &queue, int producers, int tasks_per_producer)
+{
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+    uint64_t counter = 0;
+    std::vector<std::thread> threads;
+
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&] {
+            ready++;
+            while (!go) std::this_thread::yield();
+            for (int i = 0; i < tasks_per_producer; ++i) {
+                queue.dispatch_async([&counter] { counter++; });
+            }
+        });
+    }
+
+    while (ready != producers) std::this_thread::yield();
+    auto start = osu::gettime_usec();
+    go = true;
+    for (auto &t : threads) t.join();
+    auto enqueued = osu::gettime_usec();
+    queue.dispatch_flush();
+    auto drained = osu::gettime_usec();
+
+    double total = (double) producers * tasks_per_producer;
+    printf("%-12s producers=%-3d enqueue=%8.2f Mops/s  end-to-end=%8.2f Mops/s\n", name, producers,
+           total / std::max<uint64_t>(1, enqueued - start), total / std::max<uint64_t>(1, drained - start));
+    assert(counter == (uint64_t) total);
+}
+
+// Keeps a serial queue saturated with background tasks of about task_usec each while a control
+// thread posts one task every millisecond with the given qos, and reports how long those waited.
+static void run_control_path(osu::DispatchQos qos, int samples, int task_usec)
+{
+    osu::DispatchQueue queue;
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> flooders;
+    for (int p = 0; p < 2; ++p) {
+        flooders.emplace_back([&] {
+            while (!stop) {
+                if (queue.queue_depth(osu::DispatchQos::background) > 10000) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                queue.dispatch_async(osu::DispatchQos::background, [task_usec] {
+                    auto until = osu::gettime_usec() + task_usec;
+                    while (osu::gettime_usec() < until);
+                });
+            }
+        });
+    }
+
+    std::vector<uint64_t> latency(samples);
+    size_t max_depth = 0;
+    for (int i = 0; i < samples; ++i) {
+        std::atomic<bool> ran(false);
+        auto posted = osu::gettime_usec();
+        queue.dispatch_async(qos, [&latency, &ran, posted, i] {
+            latency[i] = osu::gettime_usec() - posted;
+            ran = true;
+        });
+        max_depth = std::max(max_depth, queue.queue_depth(osu::DispatchQos::background));
+        osu::msleep(1);
+        while (!ran) std::this_thread::yield();
+    }
+
+    stop = true;
+    for (auto &t : flooders) t.join();
+
+    std::sort(latency.begin(), latency.end());
+    printf("control qos=%-11s p50=%6lu us  p99=%6lu us  max=%6lu us  background depth<=%zu\n",
+           qos == osu::DispatchQos::interactive ? "interactive" : "background",
+           (unsigned long) latency[samples / 2], (unsigned long) latency[samples * 99 / 100],
+           (unsigned long) latency[samples - 1], max_depth);
+}
+
+// About iter_ns of arithmetic the optimizer can't drop.
+static uint64_t busy_work(size_t i, int iter_ns)
+{
+    uint64_t x = i + 1;
+    for (int k = 0; k < iter_ns; ++k) {
+        x = x * 6364136223846793005ull + 1442695040888963407ull;
+    }
+    return x;
+}
+
+// dispatch_apply of n iterations against a plain loop on the calling thread.
+static void run_apply(int nworkers, size_t n, int iter_ns)
+{
+    std::vector<uint64_t> out(n);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = busy_work(i, iter_ns);
+    }
+    double serial = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    auto pool = osu::DispatchQueue::concurrent(nworkers);
+    start = std::chrono::steady_clock::now();
+    pool->dispatch_apply(n, [&out, iter_ns](size_t i) { out[i] = busy_work(i, iter_ns); });
+    double parallel = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("apply workers=%2d n=%zu  loop=%7.2f ms  apply=%7.2f ms  speedup=%5.2fx\n",
+           nworkers, n, serial * 1e3, parallel * 1e3, serial / parallel);
+}
+
+int main(int argc, char *argv[])
+{
+    osu::CommandLineParser parser(argc, argv);
+    parser.SetFlag("tasks", "200000", "tasks posted by every producer");
+    parser.SetFlag("samples", "1000", "control tasks timed while the queue is saturated");
+    parser.SetFlag("apply", "100000", "dispatch_apply iterations, each about 1us");
+    parser.ProcessFlags();
+    int tasks = atoi(parser.GetFlag("tasks").c_str());
+    int samples = atoi(parser.GetFlag("samples").c_str());
+    size_t apply = (size_t) atol(parser.GetFlag("apply").c_str());
+
+    for (int producers = 1; producers <= 32; producers *= 2) {
+        {
+            LockedQueue queue;
+            run("mutex+deque", queue, producers, tasks);
+        }
+        {
+            osu::DispatchQueue queue;
+            run("mpsc-ring", queue, producers, tasks);
+        }
+    }
+
+    // Without its own lane the control task queues behind the whole flood.
+    run_control_path(osu::DispatchQos::interactive, samples, 5);
+    run_control_path(osu::DispatchQos::background, samples / 10, 5);
+
+    int cores = std::max(1, (int) std::thread::hardware_concurrency());
+    for (int nworkers = 1; nworkers <= cores; nworkers *= 2) {
+        run_apply(nworkers, apply, 300);
+    }
+
+    return 0;
+}
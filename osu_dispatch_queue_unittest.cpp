@@ -0,0 +1,866 @@
+#include "osu.h"
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+static std::atomic<size_t> g_allocations(0);
+
+void *operator new(size_t size)
+{
+    g_allocations++;
+    void *p = malloc(size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static void test_serial_order()
+{
+    osu::DispatchQueue queue;
+    std::vector<int> order;
+    for (int i = 0; i < 100; ++i) {
+        queue.dispatch_async([&order, i] { order.push_back(i); });
+    }
+    queue.dispatch_flush();
+
+    assert(order.size() == 100);
+    for (int i = 0; i < 100; ++i) {
+        assert(order[i] == i);
+    }
+}
+
+static void test_serial_after()
+{
+    osu::DispatchQueue queue;
+    std::atomic<int> fired(0);
+    auto start = osu::gettime_msec();
+    queue.dispatch_after(20, [&] { fired++; });
+    while (fired == 0) osu::msleep(1);
+    assert(osu::gettime_msec() - start >= 20);
+
+    // Timers fire in deadline order whatever order they were armed in, and ahead of queued work.
+    std::vector<int> order;
+    for (int i : {50, 10, 30, 0, 40, 20}) {
+        queue.dispatch_after(i, [&order, i] { order.push_back(i); });
+    }
+    osu::msleep(80);
+    queue.dispatch_flush();
+    std::vector<int> expected = {0, 10, 20, 30, 40, 50};
+    assert(order == expected);
+}
+
+static void test_concurrent_fanout()
+{
+    auto queue = osu::DispatchQueue::concurrent(4);
+    std::atomic<int> sum(0);
+    for (int i = 0; i < 1000; ++i) {
+        queue->dispatch_async([&sum, &queue] {
+            // Nested work lands on the local deque and gets stolen by idle workers.
+            for (int j = 0; j < 10; ++j) {
+                queue->dispatch_async([&sum] { sum++; });
+            }
+        });
+    }
+    queue->dispatch_flush();
+    assert(sum == 10000);
+
+    int value = 0;
+    queue->dispatch_sync([&] { value = 42; });
+    assert(value == 42);
+
+    std::atomic<int> fired(0);
+    queue->dispatch_after(10, [&] { fired++; });
+    while (fired == 0) osu::msleep(1);
+
+    // A worker stuck in a long task holds up no timer, the idle one fires it.
+    auto pair = osu::DispatchQueue::concurrent(2);
+    std::atomic<int> on_time(0);
+    for (int round = 0; round < 4; ++round) {
+        std::atomic<bool> gate(false), blocked(false);
+        pair->dispatch_async([&gate, &blocked] {
+            blocked = true;
+            while (!gate) osu::msleep(1);
+        });
+        while (!blocked) osu::msleep(1);
+        pair->dispatch_after(5, [&on_time] { on_time++; });
+        auto start = osu::gettime_msec();
+        while (on_time == round && osu::gettime_msec() - start < 1000) osu::msleep(1);
+        assert(on_time == round + 1);
+        gate = true;
+        pair->dispatch_flush();
+    }
+}
+
+static void test_closure()
+{
+    std::atomic<int> value(0);
+    std::unique_ptr<int> owned(new int(7));
+
+    osu::DispatchQueue queue;
+    queue.dispatch_async([&value, owned = std::move(owned)] { value = *owned; });
+    queue.dispatch_flush();
+    assert(value == 7);
+
+    // Typical captures are stored inline, posting them must not touch the heap.
+    int a = 1, b = 2;
+    std::shared_ptr<int> shared = std::make_shared<int>(3);
+    queue.dispatch_flush();
+    size_t before = g_allocations;
+    for (int i = 0; i < 100; ++i) {
+        queue.dispatch_async([&value, a, b, shared] { value += a + b + *shared; });
+    }
+    assert(g_allocations == before);
+    queue.dispatch_flush();
+    assert(value == 7 + 600);
+
+    char big[256] = {0};
+    osu::Closure large([big] { (void) big; });
+    assert(!large.is_inline());
+    osu::Closure moved(std::move(large));
+    assert(moved && !large);
+}
+
+static void test_batch()
+{
+    for (size_t max_batch : {0, 1, 4}) {
+        osu::DispatchQueue queue;
+        queue.set_max_batch(max_batch);
+
+        // Hold the worker so the ring fills up and spills into the overflow queue.
+        std::atomic<bool> release(false);
+        queue.dispatch_async([&] { while (!release) osu::msleep(1); });
+
+        std::vector<int> order;
+        for (int i = 0; i < 5000; ++i) {
+            queue.dispatch_async([&order, i] { order.push_back(i); });
+        }
+        release = true;
+        queue.dispatch_flush();
+
+        assert(order.size() == 5000);
+        for (int i = 0; i < 5000; ++i) {
+            assert(order[i] == i);
+        }
+    }
+
+    osu::DispatchQueueMain main_queue;
+    main_queue.set_max_batch(2);
+    std::vector<int> order;
+    std::thread poster([&] {
+        for (int i = 0; i < 10; ++i) {
+            main_queue.dispatch_async([&order, i] { order.push_back(i); });
+        }
+        main_queue.stop();
+    });
+    main_queue.runMainLoop();
+    poster.join();
+    assert(order.size() == 10);
+    for (int i = 0; i < 10; ++i) {
+        assert(order[i] == i);
+    }
+}
+
+static void test_sync()
+{
+    osu::DispatchQueue queue;
+    int value = 0;
+    queue.dispatch_sync([&] {
+        // Re-entering the queue from its own thread runs inline instead of deadlocking.
+        queue.dispatch_sync([&] { value = 1; });
+        queue.dispatch_flush();
+    });
+    assert(value == 1);
+
+    size_t before = g_allocations;
+    for (int i = 0; i < 100; ++i) {
+        queue.dispatch_sync([&value] { value++; });
+    }
+    assert(g_allocations == before);
+    assert(value == 101);
+
+    std::vector<std::thread> callers;
+    int counter = 0;
+    for (int t = 0; t < 8; ++t) {
+        callers.emplace_back([&] {
+            for (int i = 0; i < 1000; ++i) {
+                queue.dispatch_sync([&counter] { counter++; });
+            }
+        });
+    }
+    for (auto &t : callers) t.join();
+    assert(counter == 8000);
+
+    auto pool = osu::DispatchQueue::concurrent(2);
+    pool->dispatch_sync([&] { pool->dispatch_sync([&] { value = 2; }); });
+    assert(value == 2);
+
+    osu::DispatchQueueMain main_queue;
+    std::thread poster([&] {
+        main_queue.dispatch_sync([&] { main_queue.dispatch_sync([&] { value = 3; }); });
+        main_queue.stop();
+    });
+    main_queue.runMainLoop();
+    poster.join();
+    assert(value == 3);
+}
+
+static void test_cancel()
+{
+    using namespace std::chrono;
+
+    osu::DispatchTimer survivor;
+    {
+        osu::DispatchQueue queue;
+        std::atomic<int> fired(0);
+        auto payload = std::make_shared<int>(1);
+
+        auto timer = queue.dispatch_after(milliseconds(30), [&fired, payload] { fired++; });
+        assert(timer.pending());
+        assert(payload.use_count() == 2);
+        bool cancelled = timer.cancel();
+        assert(cancelled);
+        // The closure is released by cancel itself, not when the deadline comes round.
+        assert(payload.use_count() == 1);
+        assert(!timer.pending());
+        cancelled = timer.cancel();
+        assert(!cancelled);
+
+        auto quick = queue.dispatch_after(microseconds(500), [&fired] { fired += 10; });
+        osu::msleep(50);
+        queue.dispatch_flush();
+        assert(fired == 10);
+        cancelled = quick.cancel();
+        assert(!cancelled);
+
+        survivor = queue.dispatch_after(seconds(10), [] {});
+    }
+    // The queue is gone, cancelling must still be safe.
+    bool settled = !survivor.pending() || survivor.cancel();
+    assert(settled);
+
+    auto pool = osu::DispatchQueue::concurrent(2);
+    std::atomic<int> fired(0);
+    std::vector<osu::DispatchTimer> timers;
+    for (int i = 0; i < 100; ++i) {
+        timers.push_back(pool->dispatch_after(milliseconds(20), [&fired] { fired++; }));
+    }
+    for (int i = 0; i < 100; i += 2) {
+        bool cancelled = timers[i].cancel();
+        assert(cancelled);
+    }
+    osu::msleep(60);
+    pool->dispatch_flush();
+    assert(fired == 50);
+}
+
+static void test_qos()
+{
+    using osu::DispatchQos;
+    osu::DispatchQueue queue;
+    std::atomic<bool> gate(false), blocked(false);
+    auto block = [&gate, &blocked] {
+        blocked = true;
+        while (!gate) osu::msleep(1);
+    };
+    queue.dispatch_async(block);
+    while (!blocked) osu::msleep(1);
+
+    // Queued behind a blocked worker: 100 normal, 10 background, then 10 interactive last of all.
+    std::vector<int> order;
+    for (int i = 0; i < 100; ++i) {
+        queue.dispatch_async([&order] { order.push_back(1); });
+    }
+    for (int i = 0; i < 10; ++i) {
+        queue.dispatch_async(DispatchQos::background, [&order] { order.push_back(2); });
+    }
+    for (int i = 0; i < 10; ++i) {
+        queue.dispatch_async(DispatchQos::interactive, [&order] { order.push_back(0); });
+    }
+    assert(queue.queue_depth(DispatchQos::interactive) == 10);
+    assert(queue.queue_depth(DispatchQos::normal) == 100);
+    assert(queue.queue_depth(DispatchQos::background) == 10);
+
+    gate = true;
+    queue.dispatch_flush();
+    assert(order.size() == 120);
+    assert(queue.queue_depth(DispatchQos::normal) == 0);
+
+    // Interactive goes first, background is aged in long before the normal lane runs dry.
+    for (int i = 0; i < 10; ++i) {
+        assert(order[i] == 0);
+    }
+    size_t first_background = std::find(order.begin(), order.end(), 2) - order.begin();
+    size_t last_normal = std::find(order.rbegin(), order.rend(), 1).base() - order.begin() - 1;
+    assert(first_background < last_normal);
+
+    // Same on a concurrent queue with a single worker.
+    auto pool = osu::DispatchQueue::concurrent(1);
+    gate = false;
+    blocked = false;
+    order.clear();
+    pool->dispatch_async(block);
+    while (!blocked) osu::msleep(1);
+    for (int i = 0; i < 50; ++i) {
+        pool->dispatch_async(DispatchQos::background, [&order] { order.push_back(2); });
+    }
+    pool->dispatch_async(DispatchQos::interactive, [&order] { order.push_back(0); });
+    assert(pool->queue_depth(DispatchQos::background) == 50);
+    assert(pool->queue_depth(DispatchQos::interactive) == 1);
+    gate = true;
+    pool->dispatch_flush();
+    assert(order.size() == 51 && order[0] == 0);
+}
+
+static void test_group_barrier()
+{
+    auto pool = osu::DispatchQueue::concurrent(4);
+    osu::DispatchQueue serial;
+    osu::DispatchGroup group;
+    std::atomic<int> sum(0);
+    std::atomic<int> notified(0);
+
+    for (int i = 0; i < 100; ++i) {
+        group.dispatch_async(*pool, [&sum] {
+            osu::msleep(1);
+            sum++;
+        });
+    }
+    group.notify(serial, [&] { notified = sum.load(); });
+    group.wait();
+    assert(sum == 100);
+    while (notified == 0) osu::msleep(1);
+    assert(notified == 100);
+
+    // Empty group: notify fires right away, wait returns at once.
+    group.notify(serial, [&] { notified = -1; });
+    group.wait();
+    while (notified != -1) osu::msleep(1);
+
+    group.enter();
+    bool drained = group.wait(std::chrono::milliseconds(5));
+    assert(!drained);
+    group.leave();
+    drained = group.wait(std::chrono::milliseconds(5));
+    assert(drained);
+
+    // The barrier sees all of the first wave done and nothing running, the second wave sees it done.
+    std::atomic<int> running(0), first(0), late(0);
+    std::atomic<bool> barrier_ran(false);
+    for (int i = 0; i < 50; ++i) {
+        pool->dispatch_async([&] {
+            running++;
+            osu::msleep(1);
+            first++;
+            running--;
+        });
+    }
+    pool->dispatch_barrier_async([&] {
+        assert(first == 50 && running == 0);
+        osu::msleep(5);
+        barrier_ran = true;
+    });
+    for (int i = 0; i < 50; ++i) {
+        pool->dispatch_async([&] {
+            if (!barrier_ran) late++;
+        });
+    }
+    pool->dispatch_flush();
+    assert(barrier_ran && late == 0);
+
+    // Back to back barriers on an idle queue.
+    std::vector<int> order;
+    for (int i = 0; i < 10; ++i) {
+        pool->dispatch_barrier_async([&order, i] { order.push_back(i); });
+    }
+    pool->dispatch_flush();
+    std::vector<int> expected = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+    assert(order == expected);
+}
+
+static void test_future()
+{
+    osu::DispatchQueue io, compute;
+    auto pool = osu::DispatchQueue::concurrent(2);
+
+    auto answer = osu::dispatch_async(compute, [] { return 6; });
+    assert(answer.get() == 6);
+
+    // Each step hops to another queue, no thread waits in between.
+    std::atomic<bool> chained(false);
+    auto chain = osu::dispatch_async(io, [] { return std::string("21"); })
+            .then(compute, [](std::string s) { return atoi(s.c_str()); })
+            .then(*pool, [](int n) { return n * 2; })
+            .then(io, [&chained](int n) {
+                chained = true;
+                return std::unique_ptr<int>(new int(n));
+            });
+    assert(*chain.get() == 42 && chained);
+
+    // An exception skips the rest of the chain and comes out of get().
+    std::atomic<int> skipped(0);
+    auto failed = osu::dispatch_async(compute, []() -> int { throw std::runtime_error("boom"); })
+            .then(io, [&skipped](int n) {
+                skipped++;
+                return n;
+            });
+    bool caught = false;
+    try {
+        failed.get();
+    } catch (std::runtime_error const &) {
+        caught = true;
+    }
+    assert(caught && skipped == 0);
+
+    // void results, and a continuation attached after the value is already there.
+    auto done = osu::dispatch_async(io, [] {});
+    done.wait();
+    assert(done.ready());
+    int after = 0;
+    done.then(compute, [&after] { after = 1; }).get();
+    assert(after == 1);
+
+    osu::DispatchPromise<int> promise;
+    auto manual = promise.get_future().then(io, [](int n) { return n + 1; });
+    promise.set_value(1);
+    assert(manual.get() == 2);
+
+    // get() used the future up, like std::future it throws rather than touching a missing state.
+    assert(!answer.valid());
+    bool no_state = false;
+    try {
+        answer.wait();
+    } catch (std::future_error const &e) {
+        no_state = e.code() == std::future_errc::no_state;
+    }
+    assert(no_state);
+
+    auto broken = osu::DispatchPromise<int>().get_future();
+    caught = false;
+    try {
+        broken.get();
+    } catch (std::future_error const &) {
+        caught = true;
+    }
+    assert(caught);
+}
+
+static void test_stats()
+{
+    // Buckets are at most 1/8 wide.
+    osu::Histogram histogram;
+    for (uint64_t v = 1; v <= 1000; ++v) {
+        histogram.record(v * 1000);
+    }
+    osu::HistogramSnapshot snapshot;
+    histogram.snapshot(snapshot);
+    assert(snapshot.count == 1000 && snapshot.max == 1000000);
+    for (double p : {10.0, 50.0, 99.0}) {
+        uint64_t exact = (uint64_t) (p * 10 + 1) * 1000;
+        assert(snapshot.percentile(p) <= exact && snapshot.percentile(p) >= exact * 7 / 8);
+    }
+
+    osu::DispatchQueue queue;
+    queue.dispatch_async([] {});
+    queue.dispatch_flush();
+    assert(queue.stats().run.count == 0);
+
+    queue.set_stats_enabled(true);
+    std::atomic<bool> gate(false), blocked(false);
+    queue.dispatch_async([&gate, &blocked] {
+        blocked = true;
+        while (!gate) osu::msleep(1);
+    });
+    while (!blocked) osu::msleep(1);
+    for (int i = 0; i < 50; ++i) {
+        queue.dispatch_async([] {});
+    }
+    osu::msleep(2);
+    gate = true;
+    queue.dispatch_after(std::chrono::milliseconds(5), [] {});
+    osu::msleep(20);
+    queue.dispatch_flush();
+
+    osu::DispatchQueueStats stats = queue.stats();
+    size_t normal = (size_t) osu::DispatchQos::normal;
+    assert(stats.run.count >= 52);
+    // The blocker ran for at least 2ms, the 50 behind it waited as long.
+    assert(stats.run.max >= 2000000);
+    assert(stats.wait.count >= 51 && stats.wait.percentile(50) >= 1000000);
+    assert(stats.timer_lateness.count == 1);
+    assert(stats.depth_high_water[normal] >= 50);
+    assert(stats.depth[normal] == 0);
+
+    auto pool = osu::DispatchQueue::concurrent(2);
+    pool->set_stats_enabled(true);
+    for (int i = 0; i < 100; ++i) {
+        pool->dispatch_async(osu::DispatchQos::background, [] {});
+    }
+    pool->dispatch_after(1, [] {});
+    osu::msleep(10);
+    pool->dispatch_flush();
+    stats = pool->stats();
+    assert(stats.run.count == 101 && stats.wait.count == 101);
+    assert(stats.timer_lateness.count == 1);
+    assert(stats.depth_high_water[(size_t) osu::DispatchQos::background] >= 1);
+}
+
+static void test_capacity()
+{
+    using osu::DispatchOverflow;
+    using osu::DispatchQos;
+
+    // Serial, concurrent and pooled.
+    for (int kind = 0; kind < 3; ++kind) {
+        osu::DispatchQueueOptions options;
+        options.concurrent = kind == 1;
+        options.nworkers = 1;
+        if (kind == 2) {
+            options.target = osu::DispatchQueue::concurrent(2);
+        }
+        std::unique_ptr<osu::DispatchQueue> queue(new osu::DispatchQueue(options));
+        std::atomic<bool> gate(false), blocked(false);
+        std::vector<int> ran;
+        auto hold = [&] {
+            gate = false;
+            blocked = false;
+            queue->dispatch_async([&gate, &blocked] {
+                blocked = true;
+                while (!gate) osu::msleep(1);
+            });
+            while (!blocked) osu::msleep(1);
+        };
+
+        queue->set_capacity(4, DispatchOverflow::reject);
+        hold();
+        for (int i = 0; i < 6; ++i) {
+            bool queued = queue->try_dispatch_async([&ran, i] { ran.push_back(i); });
+            assert(queued == (i < 4));
+        }
+        queue->dispatch_async([&ran] { ran.push_back(-1); });
+        // Not counted, so never shed.
+        queue->dispatch_after(1, [] {});
+        assert(queue->stats().rejected == 3);
+        // The future of a shed task breaks instead of never completing.
+        auto shed = osu::dispatch_async(*queue, [] { return 1; });
+        bool broken = false;
+        try {
+            shed.get();
+        } catch (std::future_error const &e) {
+            broken = e.code() == std::future_errc::broken_promise;
+        }
+        assert(broken);
+        gate = true;
+        queue->dispatch_flush();
+        assert((ran == std::vector<int>{0, 1, 2, 3}));
+
+        // The background task goes first, then the oldest normal one. A shed group task still leaves.
+        ran.clear();
+        queue->set_capacity(2, DispatchOverflow::drop_oldest);
+        hold();
+        osu::DispatchGroup group;
+        group.dispatch_async(*queue, DispatchQos::background, [&ran] { ran.push_back(10); });
+        for (int i = 20; i < 23; ++i) {
+            queue->dispatch_async([&ran, i] { ran.push_back(i); });
+        }
+        assert(queue->stats().dropped == 2);
+        bool queued = queue->try_dispatch_async([] {});
+        assert(!queued);
+        gate = true;
+        bool left = group.wait(std::chrono::seconds(1));
+        assert(left);
+        queue->dispatch_flush();
+        assert((ran == std::vector<int>{21, 22}));
+
+        ran.clear();
+        queue->set_capacity(1, DispatchOverflow::block);
+        hold();
+        queue->dispatch_async([&ran] { ran.push_back(1); });
+        std::atomic<bool> posted(false);
+        std::thread producer([&] {
+            queue->dispatch_async([&ran] { ran.push_back(2); });
+            posted = true;
+        });
+        osu::msleep(20);
+        assert(!posted);
+        gate = true;
+        producer.join();
+        queue->dispatch_flush();
+        assert((ran == std::vector<int>{1, 2}));
+        assert(queue->stats().rejected == 5 && queue->stats().dropped == 2);
+    }
+}
+
+static void test_thread_options()
+{
+    int cpu = 0;
+#if defined(__linux__)
+    // The first CPU this thread may run on, CPU 0 may well be outside the test's cpuset.
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    while (cpu < CPU_SETSIZE - 1 && !CPU_ISSET(cpu, &allowed)) cpu++;
+#endif
+
+    osu::DispatchQueueOptions options;
+    options.thread.name = "osu-test";
+    options.thread.cpus = {cpu};
+    auto serial = osu::DispatchQueue::create(options);
+    options.concurrent = true;
+    options.nworkers = 2;
+    auto pool = osu::DispatchQueue::create(options);
+
+#if defined(__linux__)
+    auto check = [cpu](std::string expected) {
+        char name[16] = {0};
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+        assert(expected == name);
+        cpu_set_t set;
+        pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+        assert(CPU_COUNT(&set) == 1 && CPU_ISSET(cpu, &set));
+    };
+    serial->dispatch_sync([&] { check("osu-test"); });
+    osu::DispatchGroup group;
+    for (int i = 0; i < 2; ++i) {
+        group.dispatch_async(*pool, [&] {
+            char name[16] = {0};
+            pthread_getname_np(pthread_self(), name, sizeof(name));
+            check(std::string(name) == "osu-test-0" ? "osu-test-0" : "osu-test-1");
+        });
+    }
+    group.wait();
+#endif
+}
+
+static void test_pooled()
+{
+    struct session {
+        std::shared_ptr<osu::DispatchQueue> queue;
+        std::atomic<bool> inside{false};
+        std::vector<int> order;
+    };
+
+    osu::DispatchQueueOptions options;
+    options.target = osu::DispatchQueue::concurrent(4);
+    std::vector<std::unique_ptr<session> > sessions;
+    for (int i = 0; i < 1000; ++i) {
+        sessions.emplace_back(new session());
+        sessions.back()->queue = osu::DispatchQueue::create(options);
+    }
+
+    // In order and one at a time per queue, whatever the pool does.
+    osu::DispatchGroup group;
+    for (int n = 0; n < 50; ++n) {
+        for (auto &s : sessions) {
+            session *p = s.get();
+            group.dispatch_async(*p->queue, [p, n] {
+                assert(!p->inside.exchange(true));
+                p->order.push_back(n);
+                p->inside = false;
+            });
+        }
+    }
+    group.wait();
+    for (auto &s : sessions) {
+        assert(s->order.size() == 50);
+        for (int n = 0; n < 50; ++n) {
+            assert(s->order[n] == n);
+        }
+    }
+
+    auto &queue = *sessions[0]->queue;
+    int value = 0;
+    queue.dispatch_sync([&value, &queue] {
+        queue.dispatch_sync([&value] { value = 1; });
+    });
+    assert(value == 1);
+
+    std::atomic<int> fired(0);
+    queue.dispatch_after(std::chrono::milliseconds(5), [&fired] { fired++; });
+    osu::DispatchTimer timer = queue.dispatch_after(std::chrono::milliseconds(5), [&fired] { fired += 10; });
+    bool cancelled = timer.cancel();
+    assert(cancelled);
+    osu::msleep(30);
+    queue.dispatch_flush();
+    assert(fired == 1);
+
+    // Pending work still runs when the queue goes, even from the only thread of its target.
+    auto single = osu::DispatchQueue::concurrent(1);
+    osu::DispatchQueueOptions on_single;
+    on_single.target = single;
+    std::shared_ptr<osu::DispatchQueue> doomed = osu::DispatchQueue::create(on_single);
+    std::atomic<int> ran(0);
+    single->dispatch_sync([&] {
+        for (int i = 0; i < 10; ++i) {
+            doomed->dispatch_async([&ran] { ran++; });
+        }
+        doomed.reset();
+    });
+    assert(ran == 10);
+    sessions.clear();
+}
+
+static void test_main_fd()
+{
+#if defined(__linux__)
+    osu::DispatchQueueMain main_queue;
+    int fds[2];
+    int rc = pipe2(fds, O_NONBLOCK);
+    assert(rc == 0);
+    int sv[2];
+    rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv);
+    assert(rc == 0);
+
+    std::string received;
+    bool hangup = false;
+    int writable = 0;
+    rc = main_queue.add_fd(fds[0], osu::dispatch_fd_readable, [&](uint32_t ready) {
+        char buf[16];
+        ssize_t n;
+        while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+            received.append(buf, n);
+        }
+        if (n == 0 || (ready & osu::dispatch_fd_error)) {
+            hangup = true;
+            main_queue.remove_fd(fds[0]);
+            main_queue.stop();
+        }
+    });
+    assert(rc == 0);
+    rc = main_queue.add_fd(fds[0], osu::dispatch_fd_readable, [](uint32_t) {});
+    assert(rc == -1 && errno == EEXIST);
+
+    // Writable right away, one call and it switches itself off.
+    rc = main_queue.add_fd(sv[0], osu::dispatch_fd_writable, [&](uint32_t ready) {
+        assert(ready & osu::dispatch_fd_writable);
+        writable++;
+        main_queue.update_fd(sv[0], 0);
+    });
+    assert(rc == 0);
+
+    std::thread writer([&] {
+        for (const char *chunk : {"hello ", "main ", "loop"}) {
+            ssize_t n = write(fds[1], chunk, strlen(chunk));
+            assert(n > 0);
+            osu::msleep(5);
+        }
+        // Tasks and fds share the loop.
+        main_queue.dispatch_sync([&] { assert(writable == 1); });
+        close(fds[1]);
+    });
+    main_queue.runMainLoop();
+    writer.join();
+    assert(received == "hello main loop" && hangup && writable == 1);
+    rc = main_queue.remove_fd(sv[0]);
+    assert(rc == 0);
+    close(fds[0]);
+    close(sv[0]);
+    close(sv[1]);
+#endif
+}
+
+static void test_main_timers()
+{
+    using namespace std::chrono;
+
+    osu::DispatchQueueMain main_queue;
+    std::vector<std::string> events;
+    auto start = steady_clock::now();
+    steady_clock::time_point fired_at;
+
+    main_queue.dispatch_after(milliseconds(20), [&] {
+        fired_at = steady_clock::now();
+        events.push_back("after");
+    });
+    osu::DispatchTimer cancelled = main_queue.dispatch_after(milliseconds(10), [&] { events.push_back("cancelled"); });
+    bool was_pending = cancelled.cancel();
+    assert(was_pending);
+
+    int ticks = 0;
+    osu::DispatchTimer repeating;
+    repeating = main_queue.dispatch_repeating(milliseconds(5), [&] {
+        // Cancelling itself from inside a run.
+        if (++ticks == 4) {
+            bool stopped = repeating.cancel();
+            assert(stopped);
+        }
+    });
+
+    // Idle work waits for the queue to run dry.
+    main_queue.dispatch_async([&] {
+        main_queue.dispatch_idle([&] { events.push_back("idle"); });
+        main_queue.dispatch_async([&] { events.push_back("task"); });
+    });
+    main_queue.dispatch_after(milliseconds(60), [&] { main_queue.stop(); });
+    main_queue.runMainLoop();
+
+    assert(ticks == 4 && !repeating.pending());
+    assert((events == std::vector<std::string>{"task", "idle", "after"}));
+    // Never early, and not polled at a coarse interval either.
+    assert(fired_at - start >= milliseconds(20) && fired_at - start < milliseconds(40));
+}
+
+static void test_apply()
+{
+    auto pool = osu::DispatchQueue::concurrent(4);
+    osu::DispatchQueue serial;
+    for (osu::DispatchQueue *queue : {pool.get(), &serial}) {
+        for (size_t n : {0, 1, 7, 1000, 100000}) {
+            std::vector<std::atomic<int> > hits(n);
+            for (auto &h : hits) h = 0;
+            queue->dispatch_apply(n, [&hits](size_t i) { hits[i]++; });
+            for (auto &h : hits) assert(h == 1);
+        }
+
+        std::atomic<size_t> sum(0), ranges(0);
+        queue->dispatch_apply_range(10000, [&](size_t begin, size_t end) {
+            assert(end - begin >= 16 || end == 10000);
+            ranges++;
+            for (size_t i = begin; i < end; ++i) sum += i;
+        }, 16);
+        assert(sum == 10000 * 9999 / 2 && ranges <= 10000 / 16 + 1);
+    }
+
+    // From inside a worker, helpers included, with every worker busy.
+    std::atomic<size_t> total(0);
+    osu::DispatchGroup group;
+    for (int i = 0; i < 4; ++i) {
+        group.dispatch_async(*pool, [&] {
+            pool->dispatch_apply(1000, [&](size_t) { total++; });
+        });
+    }
+    group.wait();
+    assert(total == 4000);
+}
+
+int main(int argc, char *argv[])
+{
+    test_serial_order();
+    test_serial_after();
+    test_concurrent_fanout();
+    test_closure();
+    test_batch();
+    test_sync();
+    test_cancel();
+    test_qos();
+    test_group_barrier();
+    test_future();
+    test_stats();
+    test_capacity();
+    test_thread_options();
+    test_pooled();
+    test_main_fd();
+    test_main_timers();
+    test_apply();
+    std::cout << "osu_dispatch_queue_unittest passed" << std::endl;
+    return 0;
+}
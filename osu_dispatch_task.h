@@ -0,0 +1,171 @@
+#ifndef PROJECT_OSU_DISPATCH_TASK_H
+#define PROJECT_OSU_DISPATCH_TASK_H
+
+// Coroutine layer over the dispatch queues, only there when the compiler does C++20 coroutines
+// (configure with -DOSU_COROUTINES=ON).
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include "osu_dispatch_queue.h"
+#include "osu_dispatch_future.h"
+
+namespace osu {
+
+    template<typename T>
+    class DispatchTask;
+
+    // Result slot of a DispatchTask frame.
+    template<typename T>
+    struct dispatch_task_result {
+        dispatch_future_value<T> value;
+        std::exception_ptr error;
+
+        template<typename U>
+        void return_value(U &&v) {
+            value.set(std::forward<U>(v));
+        }
+
+        void publish(DispatchPromise<T> &promise) {
+            if (error) {
+                promise.set_exception(error);
+            } else {
+                promise.set_value(value.take());
+            }
+        }
+    };
+
+    template<>
+    struct dispatch_task_result<void> {
+        dispatch_future_value<void> value;
+        std::exception_ptr error;
+
+        void return_void() {}
+
+        void publish(DispatchPromise<void> &promise) {
+            if (error) {
+                promise.set_exception(error);
+            } else {
+                promise.set_value();
+            }
+        }
+    };
+
+    // Lazily started coroutine. It runs on whatever thread resumes it, a co_await queue.schedule()
+    // or queue.after() inside moves it onto a queue. Either co_await it from another coroutine, which
+    // carries on right where it finished, or start() it and get a DispatchFuture back.
+    // A whole multi-step handler costs the one frame, every hop is a coroutine handle in a Closure.
+    template<typename T = void>
+    class DispatchTask {
+    public:
+        struct promise_type : dispatch_task_result<T> {
+            // Who co_awaits us, or empty when started.
+            std::coroutine_handle<> continuation;
+            DispatchPromise<T> started;
+            bool detached = false;
+
+            DispatchTask get_return_object() {
+                return DispatchTask(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            struct final_awaiter {
+                bool await_ready() const noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                    promise_type &p = h.promise();
+                    if (p.continuation) {
+                        return p.continuation;
+                    }
+                    if (p.detached) {
+                        p.publish(p.started);
+                        h.destroy();
+                    }
+                    return std::noop_coroutine();
+                }
+
+                void await_resume() const noexcept {}
+            };
+
+            final_awaiter final_suspend() noexcept { return {}; }
+
+            void unhandled_exception() {
+                this->error = std::current_exception();
+            }
+        };
+
+        using handle_type = std::coroutine_handle<promise_type>;
+
+        DispatchTask() {}
+
+        DispatchTask(DispatchTask &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+        DispatchTask &operator=(DispatchTask &&other) noexcept {
+            if (this != &other) {
+                reset();
+                handle_ = std::exchange(other.handle_, nullptr);
+            }
+            return *this;
+        }
+
+        ~DispatchTask() {
+            reset();
+        }
+
+        bool valid() const {
+            return handle_ != nullptr;
+        }
+
+        struct awaiter {
+            handle_type handle;
+
+            bool await_ready() const noexcept { return false; }
+
+            // Symmetric transfer: straight into the task, and straight back out when it is done.
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+                handle.promise().continuation = caller;
+                return handle;
+            }
+
+            T await_resume() {
+                promise_type &p = handle.promise();
+                if (p.error) {
+                    std::rethrow_exception(p.error);
+                }
+                return p.value.take();
+            }
+        };
+
+        awaiter operator co_await() && {
+            return awaiter{handle_};
+        }
+
+        // Runs the task on the calling thread up to its first suspension. The frame frees itself
+        // when done; the future carries the result or the exception.
+        DispatchFuture<T> start() && {
+            handle_type h = std::exchange(handle_, nullptr);
+            h.promise().detached = true;
+            DispatchFuture<T> future = h.promise().started.get_future();
+            h.resume();
+            return future;
+        }
+
+    private:
+        explicit DispatchTask(handle_type h) : handle_(h) {}
+
+        void reset() {
+            if (handle_) {
+                handle_.destroy();
+                handle_ = nullptr;
+            }
+        }
+
+        handle_type handle_;
+    };
+}
+
+#endif // __cpp_impl_coroutine
+
+#endif //PROJECT_OSU_DISPATCH_TASK_H
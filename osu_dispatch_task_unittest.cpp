@@ -0,0 +1,110 @@
+#include "osu.h"
+#include "osu_dispatch_task.h"
+
+using namespace std::chrono_literals;
+
+static std::atomic<size_t> g_allocations(0);
+
+void *operator new(size_t size)
+{
+    g_allocations++;
+    void *p = malloc(size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static std::thread::id thread_of(osu::DispatchQueue &queue)
+{
+    std::thread::id id;
+    queue.dispatch_sync([&id] { id = std::this_thread::get_id(); });
+    return id;
+}
+
+static osu::DispatchTask<int> parse(osu::DispatchQueue &compute, std::string text)
+{
+    co_await compute.schedule();
+    co_return atoi(text.c_str());
+}
+
+static osu::DispatchTask<std::string> handler(osu::DispatchQueue &io, osu::DispatchQueue &compute)
+{
+    co_await io.schedule();
+    assert(std::this_thread::get_id() == thread_of(io));
+
+    int n = co_await parse(compute, "20");
+    assert(std::this_thread::get_id() == thread_of(compute));
+
+    auto start = osu::gettime_usec();
+    co_await io.after(5ms);
+    assert(osu::gettime_usec() - start >= 5000);
+    assert(std::this_thread::get_id() == thread_of(io));
+
+    co_return std::to_string(n + 22);
+}
+
+static osu::DispatchTask<> fail(osu::DispatchQueue &queue)
+{
+    co_await queue.schedule();
+    throw std::runtime_error("boom");
+}
+
+// Ping-pongs between two queues and reports how many allocations the hops made.
+static osu::DispatchTask<size_t> hops(osu::DispatchQueue &a, osu::DispatchQueue &b, int n)
+{
+    co_await a.schedule();
+    size_t before = g_allocations;
+    for (int i = 0; i < n; ++i) {
+        co_await b.schedule();
+        co_await a.schedule();
+    }
+    co_return g_allocations - before;
+}
+
+static osu::DispatchTask<> on_main(osu::DispatchQueueMain &main, std::thread::id main_thread)
+{
+    co_await main.schedule();
+    assert(std::this_thread::get_id() == main_thread);
+    main.stop();
+}
+
+int main(int argc, char *argv[])
+{
+    osu::DispatchQueue io, compute;
+
+    std::string answer = handler(io, compute).start().get();
+    assert(answer == "42");
+
+    bool caught = false;
+    try {
+        fail(io).start().get();
+    } catch (std::runtime_error const &) {
+        caught = true;
+    }
+    assert(caught);
+
+    size_t allocations = hops(io, compute, 1000).start().get();
+    assert(allocations == 0);
+
+    // A task never started or awaited just frees its frame.
+    {
+        auto unused = handler(io, compute);
+    }
+
+    osu::DispatchQueueMain main_queue;
+    auto done = on_main(main_queue, std::this_thread::get_id()).start();
+    main_queue.runMainLoop();
+    done.get();
+
+    std::cout << "osu_dispatch_task_unittest passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,132 @@
+#ifndef PROJECT_OSU_HISTOGRAM_H
+#define PROJECT_OSU_HISTOGRAM_H
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace osu {
+
+    // Log-linear bucketing: every power of two is split into 2^sub_bits buckets, so a bucket is
+    // never more than 1/2^sub_bits (12.5%) wider than the values in it. Values are clamped below 2^max_bits.
+    struct HistogramBuckets {
+        static const unsigned sub_bits = 3;
+        static const unsigned max_bits = 40;
+        static const size_t count = (max_bits - sub_bits + 1) << sub_bits;
+
+        static size_t index(uint64_t v) {
+            if (v >= (1ull << max_bits)) {
+                v = (1ull << max_bits) - 1;
+            }
+            if (v < (1ull << sub_bits)) {
+                return (size_t) v;
+            }
+            unsigned msb = 63 - __builtin_clzll(v);
+            unsigned shift = msb - sub_bits;
+            return ((size_t) (shift + 1) << sub_bits) + (size_t) ((v >> shift) - (1ull << sub_bits));
+        }
+
+        // Smallest value that lands in bucket i.
+        static uint64_t lower_bound(size_t i) {
+            if (i < (1u << sub_bits)) {
+                return i;
+            }
+            unsigned shift = (unsigned) (i >> sub_bits) - 1;
+            return ((i & ((1u << sub_bits) - 1)) + (1ull << sub_bits)) << shift;
+        }
+    };
+
+    // Plain copy of a Histogram, safe to merge and query at leisure.
+    struct HistogramSnapshot {
+        std::vector<uint64_t> buckets = std::vector<uint64_t>(HistogramBuckets::count);
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+
+        void merge(HistogramSnapshot const &other) {
+            for (size_t i = 0; i < buckets.size(); ++i) {
+                buckets[i] += other.buckets[i];
+            }
+            count += other.count;
+            sum += other.sum;
+            if (other.max > max) max = other.max;
+        }
+
+        double mean() const {
+            return count == 0 ? 0 : (double) sum / count;
+        }
+
+        // Lower bound of the bucket holding the p-th percentile (0..100), max for 100.
+        uint64_t percentile(double p) const {
+            if (count == 0) return 0;
+            if (p >= 100) return max;
+
+            uint64_t rank = (uint64_t) (p / 100 * count);
+            uint64_t seen = 0;
+            for (size_t i = 0; i < buckets.size(); ++i) {
+                seen += buckets[i];
+                if (seen > rank) {
+                    return HistogramBuckets::lower_bound(i);
+                }
+            }
+            return max;
+        }
+    };
+
+    // Histogram with a single writer and any number of readers. record() is a few relaxed loads
+    // and stores, no read-modify-write, so give each writing thread its own and merge the snapshots.
+    class Histogram {
+    public:
+        Histogram() : buckets_(new std::atomic<uint64_t>[HistogramBuckets::count]) {
+            for (size_t i = 0; i < HistogramBuckets::count; ++i) {
+                buckets_[i].store(0, std::memory_order_relaxed);
+            }
+            count_.store(0, std::memory_order_relaxed);
+            sum_.store(0, std::memory_order_relaxed);
+            max_.store(0, std::memory_order_relaxed);
+        }
+
+        ~Histogram() {
+            delete[] buckets_;
+        }
+
+        Histogram(Histogram const &) = delete;
+
+        Histogram &operator=(Histogram const &) = delete;
+
+        // Owning thread only.
+        void record(uint64_t v) {
+            bump(buckets_[HistogramBuckets::index(v)], 1);
+            bump(count_, 1);
+            bump(sum_, v);
+            if (v > max_.load(std::memory_order_relaxed)) {
+                max_.store(v, std::memory_order_relaxed);
+            }
+        }
+
+        // Any thread. Adds into out, which may already hold other histograms.
+        void snapshot(HistogramSnapshot &out) const {
+            HistogramSnapshot mine;
+            for (size_t i = 0; i < HistogramBuckets::count; ++i) {
+                mine.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+            }
+            mine.count = count_.load(std::memory_order_relaxed);
+            mine.sum = sum_.load(std::memory_order_relaxed);
+            mine.max = max_.load(std::memory_order_relaxed);
+            out.merge(mine);
+        }
+
+    private:
+        static void bump(std::atomic<uint64_t> &a, uint64_t by) {
+            a.store(a.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+        }
+
+        std::atomic<uint64_t> *buckets_;
+        std::atomic<uint64_t> count_;
+        std::atomic<uint64_t> sum_;
+        std::atomic<uint64_t> max_;
+    };
+}
+
+#endif //PROJECT_OSU_HISTOGRAM_H
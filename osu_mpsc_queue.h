@@ -0,0 +1,110 @@
+#ifndef PROJECT_OSU_MPSC_QUEUE_H
+#define PROJECT_OSU_MPSC_QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+
+namespace osu {
+
+    // Bounded lock-free multi-producer/single-consumer ring (Vyukov's bounded queue).
+    // Every cell carries a sequence number telling producers and the consumer whose turn it is,
+    // so a push is one CAS on the enqueue position and a pop touches no shared counter at all.
+    template<typename T>
+    class MpscQueue {
+        struct cell {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+
+    public:
+        // capacity is rounded up to a power of two.
+        explicit MpscQueue(size_t capacity = 1024) {
+            size_t size = 2;
+            while (size < capacity) size <<= 1;
+
+            mask_ = size - 1;
+            cells_.reset(new cell[size]);
+            for (size_t i = 0; i < size; ++i) {
+                cells_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+            enqueue_pos_.store(0, std::memory_order_relaxed);
+            dequeue_pos_.store(0, std::memory_order_relaxed);
+        }
+
+        MpscQueue(MpscQueue const &) = delete;
+
+        MpscQueue &operator=(MpscQueue const &) = delete;
+
+        // Any thread. value is moved from only when the push succeeds, false means the ring is full.
+        bool try_push(T &value) {
+            cell *c;
+            size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+            for (;;) {
+                c = &cells_[pos & mask_];
+                size_t seq = c->sequence.load(std::memory_order_acquire);
+                intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+                if (dif == 0) {
+                    if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (dif < 0) {
+                    return false;
+                } else {
+                    pos = enqueue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+
+            c->data = std::move(value);
+            c->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer thread only. An entry whose producer has not finished publishing it reads as empty.
+        bool try_pop(T &value) {
+            size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+            cell *c = &cells_[pos & mask_];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            if (seq != pos + 1) {
+                return false;
+            }
+
+            value = std::move(c->data);
+            c->data = T();
+            c->sequence.store(pos + mask_ + 1, std::memory_order_release);
+            dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        // Consumer thread only.
+        bool empty() const {
+            size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+            cell *c = &cells_[pos & mask_];
+            return c->sequence.load(std::memory_order_acquire) != pos + 1;
+        }
+
+        // Any thread. Counts entries whose producer is still publishing them.
+        size_t size_approx() const {
+            // Read from another thread the two positions may be out of step, never report less than zero.
+            size_t tail = dequeue_pos_.load(std::memory_order_relaxed);
+            size_t head = enqueue_pos_.load(std::memory_order_relaxed);
+            return head > tail ? head - tail : 0;
+        }
+
+        size_t capacity() const {
+            return mask_ + 1;
+        }
+
+    private:
+        std::unique_ptr<cell[]> cells_;
+        size_t mask_;
+        // Padding rather than alignas, the queue is embedded in heap objects and C++14 new ignores over-alignment.
+        char pad0_[64];
+        std::atomic<size_t> enqueue_pos_;
+        char pad1_[64];
+        // Only the consumer writes it, atomic so size_approx can be read from anywhere.
+        std::atomic<size_t> dequeue_pos_;
+    };
+}
+
+#endif //PROJECT_OSU_MPSC_QUEUE_H
@@ -0,0 +1,123 @@
+#include "osu_thread.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace osu {
+
+#if defined(__linux__)
+    // Parses a sysfs CPU list such as "0-3,8,10-11".
+    static std::vector<int> read_cpu_list(std::string const &path) {
+        std::vector<int> cpus;
+        std::ifstream in(path);
+        std::string range;
+        while (std::getline(in, range, ',')) {
+            int first = 0, last = 0;
+            int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (n == 1) {
+                last = first;
+            } else if (n != 2) {
+                continue;
+            }
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    // Those of cpus the calling thread may already run on.
+    static std::vector<int> allowed_of(std::vector<int> const &cpus) {
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+            return cpus;
+        }
+        std::vector<int> allowed;
+        for (int cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set)) {
+                allowed.push_back(cpu);
+            }
+        }
+        return allowed;
+    }
+
+    static int pin_to(std::vector<int> const &cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    // set_mempolicy(MPOL_PREFERRED) without pulling in libnuma.
+    static int prefer_node(int node) {
+        const int mpol_preferred = 1;
+        unsigned long mask[16] = {0};
+        if (node < 0 || node >= (int) (sizeof(mask) * 8)) {
+            return EINVAL;
+        }
+        mask[node / (sizeof(mask[0]) * 8)] = 1ul << (node % (sizeof(mask[0]) * 8));
+        if (syscall(SYS_set_mempolicy, mpol_preferred, mask, sizeof(mask) * 8) != 0) {
+            return errno;
+        }
+        return 0;
+    }
+
+    int apply_thread_options(ThreadOptions const &options) {
+        int err = 0;
+        if (!options.name.empty()) {
+            int e = pthread_setname_np(pthread_self(), options.name.substr(0, 15).c_str());
+            if (e != 0) err = e;
+        }
+
+        std::vector<int> cpus = options.cpus;
+        if (options.numa_node >= 0) {
+            if (cpus.empty()) {
+                cpus = read_cpu_list("/sys/devices/system/node/node" + std::to_string(options.numa_node) + "/cpulist");
+                if (cpus.empty()) err = ENOENT;
+                // A cpuset the process was started in is kept rather than widened.
+                cpus = allowed_of(cpus);
+            }
+            int e = prefer_node(options.numa_node);
+            if (e != 0) err = e;
+        }
+        if (!cpus.empty()) {
+            int e = pin_to(cpus);
+            if (e != 0) err = e;
+        }
+
+        if (options.fifo_priority > 0) {
+            sched_param param;
+            memset(&param, 0, sizeof(param));
+            param.sched_priority = options.fifo_priority;
+            int e = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if (e != 0) err = e;
+        }
+        return err;
+    }
+#else
+    int apply_thread_options(ThreadOptions const &options) {
+        bool wanted = !options.name.empty() || !options.cpus.empty() || options.numa_node >= 0 ||
+                      options.fifo_priority > 0;
+        return wanted ? ENOTSUP : 0;
+    }
+#endif
+
+    void apply_thread_options_or_warn(ThreadOptions const &options) {
+        int err = apply_thread_options(options);
+        if (err != 0) {
+            fprintf(stderr, "WARN:thread options of '%s' not fully applied: %s\n", options.name.c_str(), strerror(err));
+        }
+    }
+}
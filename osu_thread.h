@@ -0,0 +1,31 @@
+#ifndef PROJECT_OSU_THREAD_H
+#define PROJECT_OSU_THREAD_H
+
+#include <string>
+#include <vector>
+
+namespace osu {
+
+    // Where and how a thread the library starts runs. Every field is optional, one left at its
+    // default keeps whatever the thread inherited.
+    struct ThreadOptions {
+        // Shown by top -H and perf. Linux cuts it to 15 characters; worker threads get "-<index>" appended.
+        std::string name;
+        // CPUs the thread may run on, empty for any.
+        std::vector<int> cpus;
+        // NUMA node the thread keeps to, -1 for none. Its allocations prefer the node's memory and,
+        // unless cpus is given, it is also pinned: to the node's CPUs among those it may already run on.
+        int numa_node = -1;
+        // SCHED_FIFO priority 1..99, 0 stays with the normal scheduler. Needs CAP_SYS_NICE or an rtprio limit.
+        int fifo_priority = 0;
+    };
+
+    // Applies options to the calling thread. Best effort: a step that fails does not stop the others,
+    // and the errno of the last one that failed is returned, 0 when all of it took.
+    int apply_thread_options(ThreadOptions const &options);
+
+    // apply_thread_options for threads that have nobody to return an error to, the failure goes to stderr.
+    void apply_thread_options_or_warn(ThreadOptions const &options);
+}
+
+#endif //PROJECT_OSU_THREAD_H
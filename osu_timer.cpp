@@ -3,13 +3,24 @@
 //
 
 #include "osu.h"
-#include <queue>
+#include "osu_timer_heap.h"
+#include "osu_timing_wheel.h"
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
 
 namespace osu {
 
-    uint64_t gettime_usec() {
+    uint64_t gettime_nsec() {
         auto tnow = std::chrono::steady_clock::now();
-        return std::chrono::duration_cast<std::chrono::microseconds>(tnow.time_since_epoch()).count();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(tnow.time_since_epoch()).count();
+    }
+
+    uint64_t gettime_usec() {
+        return gettime_nsec()/1000;
     }
 
     uint64_t gettime_msec() {
@@ -28,149 +39,511 @@ namespace osu {
         std::this_thread::sleep_for(std::chrono::microseconds(usec));
     }
 
+    // Link is how the timer's schedule files it: TimerHeapNode or TimingWheelNode.
+    template<typename Link>
     struct Timer {
-        std::function<void()> lamdaCb;
-        uint64_t timeout;
-        uint64_t delay_msec;
-        int repeat;
-        uint64_t start_id;
+        Link link;
+        Closure lamdaCb;
+        // steady clock, nanoseconds. For a repeating timer always first deadline + n * period.
+        uint64_t deadline = 0;
+        uint64_t period = 0;
+        // How late past deadline it may fire, so that it shares a wakeup with others.
+        uint64_t slack = 0;
+        int repeat = 0;
+        // Bumped on every release, so the ids handed out for the slot before no longer resolve.
+        uint32_t gen = 1;
+        uint32_t slot = 0;
+        // Next free slot while released.
+        uint32_t next_free = 0;
+        // Shard the timer was created in, its slab and its submissions live there.
+        uint8_t shard = 0;
+        bool live = false;
+        // Taken out of the schedule by run_loop and its callback not returned yet. run_loop only.
+        bool firing = false;
+        // Queued for release by run_loop, its gen is bumped only once the shard lock is taken. run_loop only.
+        bool released = false;
+        // Set by delete_timer, run_loop drops the timer when it gets to the cancellation.
+        std::atomic<bool> cancelled{false};
     };
-    using TimerPtr=std::shared_ptr<Timer>;
 
+    // Timers in chunks that never move, so a callback can run while other threads create more.
+    // Released slots are reused, so timer churn allocates nothing once the slab has grown to the peak.
+    // Not thread safe.
     template<typename T>
-    class MinHeap : public std::priority_queue<T, std::vector<T>> {
+    class TimerSlab {
     public:
-        bool remove(const T &value) {
-            auto it = std::find(this->c.begin(), this->c.end(), value);
-            if (it != this->c.end()) {
-                this->c.erase(it);
-                std::make_heap(this->c.begin(), this->c.end(), this->comp);
-                return true;
-            } else {
-                return false;
+        static const uint32_t chunk_size = 1024;
+
+        explicit TimerSlab(uint8_t shard) : shard_(shard), free_(none), live_(0) {}
+
+        size_t size() const {
+            return live_;
+        }
+
+        T *alloc() {
+            if (free_ == none) {
+                grow();
             }
+            T *timer = at(free_);
+            free_ = timer->next_free;
+            timer->live = true;
+            timer->firing = false;
+            timer->released = false;
+            timer->cancelled.store(false, std::memory_order_relaxed);
+            live_++;
+            return timer;
         }
+
+        // Drops the closure and makes every id of the timer stale.
+        void release(T *timer) {
+            timer->lamdaCb = nullptr;
+            timer->live = false;
+            timer->gen++;
+            timer->next_free = free_;
+            free_ = timer->slot;
+            live_--;
+        }
+
+        // gen:24 shard:8 slot:32. An id comes back after 2^24 reuses of its slot.
+        static uint64_t id_of(T const *timer) {
+            return ((uint64_t) (timer->gen & 0xffffff) << 40) | ((uint64_t) timer->shard << 32) | timer->slot;
+        }
+
+        static uint8_t shard_of(uint64_t id) {
+            return (uint8_t) (id >> 32);
+        }
+
+        // nullptr for an id whose timer was released since.
+        T *find(uint64_t id) {
+            uint32_t slot = (uint32_t) id;
+            if (slot >= chunks_.size() * chunk_size) {
+                return nullptr;
+            }
+            T *timer = at(slot);
+            return timer->live && (timer->gen & 0xffffff) == (uint32_t) (id >> 40) ? timer : nullptr;
+        }
+
+    private:
+        static const uint32_t none = UINT32_MAX;
+
+        T *at(uint32_t slot) {
+            return &chunks_[slot / chunk_size][slot % chunk_size];
+        }
+
+        void grow() {
+            uint32_t base = (uint32_t) (chunks_.size() * chunk_size);
+            chunks_.emplace_back(new T[chunk_size]);
+            for (uint32_t i = chunk_size; i-- > 0;) {
+                T *timer = at(base + i);
+                timer->slot = base + i;
+                timer->shard = shard_;
+                timer->next_free = free_;
+                free_ = base + i;
+            }
+        }
+
+        std::vector<std::unique_ptr<T[]>> chunks_;
+        uint8_t shard_;
+        uint32_t free_;
+        size_t live_;
+    };
+
+    // The time in [earliest, latest] with the most trailing zero bits. Timers whose windows overlap
+    // tend to pick the very same time, and then fire in one wakeup.
+    static uint64_t timer_coalesce(uint64_t earliest, uint64_t latest) {
+        if (latest <= earliest) {
+            return earliest;
+        }
+        // Above the highest bit they differ in they agree; latest has that bit set, earliest doesn't.
+        unsigned bit = 63 - __builtin_clzll(earliest ^ latest);
+        return latest & ~((1ull << bit) - 1);
+    }
+
+    // Exact deadlines, O(log n) insert and remove.
+    class TimerHeapSchedule {
+    public:
+        using timer_type = Timer<TimerHeapNode>;
+
+        explicit TimerHeapSchedule(TimerQueueOptions const &) {}
+
+        bool empty() const {
+            return heap_.empty();
+        }
+
+        void insert(timer_type *timer) {
+            timer->link.expiry = timer_coalesce(timer->deadline, timer->deadline + timer->slack);
+            heap_.insert(&timer->link);
+        }
+
+        void remove(timer_type *timer) {
+            heap_.remove(&timer->link);
+        }
+
+        uint64_t next_deadline() const {
+            return heap_.next_expiry();
+        }
+
+        // Unlinks every timer due by now and calls expired(timer) for it, earliest first. A timer whose
+        // window has opened comes along too while at the top, saving it a wakeup of its own.
+        template<typename F>
+        void expire(uint64_t now, F &&expired) {
+            while (!heap_.empty()) {
+                auto *timer = OSU_CONTAINER_OF(heap_.top(), timer_type, link);
+                if (timer->link.expiry > now && timer->deadline > now) break;
+                heap_.pop();
+                expired(timer);
+            }
+        }
+
+    private:
+        TimerHeap heap_;
     };
 
+    // Deadlines rounded up to the tick, O(1) insert and remove however many timers there are.
+    class TimerWheelSchedule {
+    public:
+        using timer_type = Timer<TimingWheelNode>;
+
+        explicit TimerWheelSchedule(TimerQueueOptions const &options)
+                : tick_(std::max<uint64_t>(1, (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                options.tick).count())), wheel_(gettime_nsec() / tick_) {}
+
+        bool empty() const {
+            return wheel_.empty();
+        }
+
+        void insert(timer_type *timer) {
+            timer->link.expiry = timer_coalesce((timer->deadline + tick_ - 1) / tick_,
+                                                (timer->deadline + timer->slack) / tick_);
+            wheel_.insert(&timer->link);
+        }
+
+        void remove(timer_type *timer) {
+            wheel_.remove(&timer->link);
+        }
+
+        // A lower bound: when a coarse slot comes round its timers may only move down a level.
+        uint64_t next_deadline() const {
+            uint64_t tick = wheel_.next_event();
+            return tick == TimingWheel::never ? tick : tick * tick_;
+        }
+
+        template<typename F>
+        void expire(uint64_t now, F &&expired) {
+            wheel_.advance(now / tick_, [&](TimingWheelNode *link) {
+                expired(OSU_CONTAINER_OF(link, timer_type, link));
+            });
+        }
+
+    private:
+        uint64_t tick_;
+        TimingWheel wheel_;
+    };
+
+#if defined(__linux__)
+    // Sleeps until an absolute CLOCK_MONOTONIC (steady_clock) time on a timerfd, which unlike a condition
+    // variable takes the deadline in nanoseconds. wake() cuts the sleep short from any thread, also one
+    // that has not started yet.
+    class TimerSleeper {
+    public:
+        TimerSleeper() {
+            timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+
+        ~TimerSleeper() {
+            if (timer_fd_ >= 0) close(timer_fd_);
+            if (event_fd_ >= 0) close(event_fd_);
+        }
+
+        bool valid() const {
+            return timer_fd_ >= 0 && event_fd_ >= 0;
+        }
+
+        // deadline in nanoseconds, UINT64_MAX to sleep until woken.
+        void sleep_until(uint64_t deadline) {
+            itimerspec spec;
+            memset(&spec, 0, sizeof(spec));
+            if (deadline != UINT64_MAX) {
+                // All zero would disarm it instead.
+                deadline = std::max<uint64_t>(deadline, 1);
+                spec.it_value.tv_sec = (time_t) (deadline / 1000000000);
+                spec.it_value.tv_nsec = (long) (deadline % 1000000000);
+            }
+            timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+
+            pollfd fds[2] = {{timer_fd_, POLLIN, 0}, {event_fd_, POLLIN, 0}};
+            if (poll(fds, 2, -1) > 0) {
+                uint64_t count;
+                ssize_t n = read(event_fd_, &count, sizeof(count));
+                n = read(timer_fd_, &count, sizeof(count));
+                (void) n;
+            }
+        }
+
+        void wake() {
+            uint64_t one = 1;
+            ssize_t n = write(event_fd_, &one, sizeof(one));
+            (void) n;
+        }
+
+    private:
+        int timer_fd_;
+        int event_fd_;
+    };
+#endif
+
+    // Spreads the threads calling create_timer over the shards, each thread keeping to one.
+    static unsigned timer_shard_hint() {
+        static std::atomic<unsigned> next(0);
+        static thread_local unsigned hint = next.fetch_add(1, std::memory_order_relaxed);
+        return hint;
+    }
+
+    template<typename Schedule>
     class TimerQueueImpl: public TimerQueue {
-        int generate_timer(uint32_t delay_msec, std::function<void()> func, int repeat, uint64_t *p_timer_id);
-        std::map<uint64_t, TimerPtr> m_mapTimers;
-        MinHeap<TimerPtr> m_QTimers;
-        uint64_t m_nTimerSN;
+        using Timer = typename Schedule::timer_type;
+
+        // What a shard hands over to run_loop.
+        struct Submission {
+            enum Kind : uint8_t {
+                arm, cancel,
+                // A callback run on callback_queue returned, or was shed.
+                done
+            };
+
+            Timer *timer;
+            // Of the timer at submission, a cancel of a timer released since is dropped.
+            uint32_t gen;
+            Kind kind;
+        };
+
+        // Timers created by a few threads, and the submissions for them run_loop has yet to merge.
+        // The lock is only shared with the loop picking up the batch and dropping timers it is done with.
+        struct Shard {
+            explicit Shard(uint8_t index) : slab(index) {}
+
+            std::mutex mtx;
+            // Set while pending is not empty, so run_loop skips idle shards without locking them.
+            std::atomic<bool> dirty{false};
+            std::vector<Submission> pending;
+            TimerSlab<Timer> slab;
+            // Deleted but not released yet, count() leaves them out.
+            size_t deleted = 0;
+        };
+
+        // run_loop only, no lock.
+        Schedule m_schedule;
+        // Taken out of the schedule and about to fire.
+        std::vector<Timer *> m_ready;
+        // Swapped with a shard's pending, so both keep their capacity.
+        std::vector<Submission> m_merging;
+        // Done with, released in one go per shard.
+        std::vector<Timer *> m_released;
+
+        std::vector<std::unique_ptr<Shard>> m_shards;
+
+#if defined(__linux__)
+        // Set in high resolution mode, run_loop sleeps on it rather than on m_cond.
+        std::unique_ptr<TimerSleeper> m_sleeper;
+#endif
+        // Guards only the sleep of run_loop.
         std::mutex m_mLock;
-        bool m_isRunning;
-        bool m_stopped;
+        std::condition_variable m_cond;
+        // What run_loop sleeps until, UINT64_MAX for no timer, 0 while it is busy (and will merge anyway).
+        // A submission due earlier wakes it.
+        std::atomic<uint64_t> m_nWakeup;
+        bool m_bKick;
+        // Callbacks posted to callback_queue and not returned yet, the destructor waits for them.
+        size_t m_nInflight;
+        std::condition_variable m_idle;
+        std::atomic<uint64_t> m_nFired;
+        std::atomic<uint64_t> m_nLate;
+        std::atomic<uint64_t> m_nMissed;
+        // Times run_loop came back from sleeping.
+        std::atomic<uint64_t> m_nWakeups;
+        // Where the previous stats() call left off, for wakeups_per_sec.
+        std::mutex m_statLock;
+        uint64_t m_nStatWakeups;
+        uint64_t m_nStatTime;
+        // From deadline to the callback being started (inline) or posted (callback_queue), run_loop writes it.
+        Histogram m_error;
+        std::atomic<bool> m_isRunning;
+        std::atomic<bool> m_stopped;
+        TimerQueueOptions m_options;
 
     public:
-        TimerQueueImpl():m_nTimerSN(0), m_isRunning(false), m_stopped(false) {
+        explicit TimerQueueImpl(TimerQueueOptions const &options)
+                : m_schedule(options), m_nWakeup(0), m_bKick(false), m_nInflight(0), m_nFired(0), m_nLate(0),
+                  m_nMissed(0), m_nWakeups(0), m_nStatWakeups(0), m_nStatTime(gettime_nsec()), m_isRunning(false), m_stopped(false), m_options(options) {
             std::cout << "BMTimerQueue ctor" << std::endl;
-
+            int shards = options.shards > 0 ? options.shards : (int) std::thread::hardware_concurrency();
+            shards = std::min(std::max(shards, 1), 256);
+            for (int i = 0; i < shards; ++i) {
+                m_shards.emplace_back(new Shard((uint8_t) i));
+            }
+#if defined(__linux__)
+            if (options.high_resolution) {
+                m_sleeper.reset(new TimerSleeper());
+                if (!m_sleeper->valid()) {
+                    fprintf(stderr, "WARN:timerfd unavailable, high resolution TimerQueue falls back to a condition variable\n");
+                    m_sleeper.reset();
+                }
+            }
+#endif
         }
 
         ~TimerQueueImpl()
         {
-            m_isRunning = false;
+            stop();
             while(!m_stopped) msleep(10);
+            std::unique_lock<std::mutex> locker(m_mLock);
+            m_idle.wait(locker, [this] { return m_nInflight == 0; });
             std::cout << "BMTimerQueue dtor" << std::endl;
         }
 
-        virtual int create_timer(uint32_t delay_msec, std::function<void()> func, int repeat, uint64_t *p_timer_id) override
+        virtual int create_timer(uint32_t delay_msec, Closure func, int repeat, uint64_t *p_timer_id) override
         {
-            OSU_RETURN_EXP_IF_FAIL(p_timer_id != nullptr, return -1);
-            TimerPtr timer = std::make_shared<Timer>();
-            if (NULL == timer)
-            {
-                return -1;
-            }
-
-            timer->lamdaCb = func;
-            timer->timeout = gettime_msec() + delay_msec;
-            timer->delay_msec = delay_msec;
-            timer->start_id = m_nTimerSN ++;
-            timer->repeat = repeat;
+            return create_timer(std::chrono::milliseconds(delay_msec), std::move(func), repeat, p_timer_id);
+        }
 
-            std::unique_lock<std::mutex> locker(m_mLock);
+        virtual int create_timer(std::chrono::nanoseconds delay, Closure func, int repeat, uint64_t *p_timer_id) override
+        {
+            return create_timer(delay, std::chrono::nanoseconds(0), std::move(func), repeat, p_timer_id);
+        }
 
-            // Add to Heap
-            m_QTimers.push(timer);
+        virtual int create_timer(std::chrono::nanoseconds delay, std::chrono::nanoseconds slack, Closure func,
+                                 int repeat, uint64_t *p_timer_id) override
+        {
+            OSU_RETURN_EXP_IF_FAIL(p_timer_id != nullptr, return -1);
+            uint64_t period = (uint64_t) std::max<int64_t>(0, delay.count());
+            uint64_t timer_slack = (uint64_t) std::max<int64_t>(0, slack.count());
+            uint64_t deadline = gettime_nsec() + period;
 
-            // Add to HashTable
-            m_mapTimers[timer->start_id] = timer;
-            if (p_timer_id)
+            Shard &shard = *m_shards[timer_shard_hint() % m_shards.size()];
             {
-                *p_timer_id = timer->start_id;
+                std::unique_lock<std::mutex> locker(shard.mtx);
+                Timer *timer = shard.slab.alloc();
+                timer->lamdaCb = std::move(func);
+                timer->deadline = deadline;
+                timer->period = period;
+                timer->slack = timer_slack;
+                timer->repeat = repeat;
+                *p_timer_id = TimerSlab<Timer>::id_of(timer);
+                submit(shard, Submission{timer, timer->gen, Submission::arm});
+            }
+
+            // Only a window closing before the wakeup planned is worth a wakeup of its own.
+            if (deadline + timer_slack < m_nWakeup.load()) {
+                kick();
             }
 
             return 0;
         }
 
         virtual int delete_timer(uint64_t timer_id) override {
-            std::unique_lock<std::mutex> locker(m_mLock);
-            if (m_mapTimers.find(timer_id) == m_mapTimers.end())
-            {
-                std::cout << "delete_timer(),can't find timer = " << timer_id << std::endl;
-                return 0;
+            uint8_t index = TimerSlab<Timer>::shard_of(timer_id);
+            Timer *timer = nullptr;
+            if (index < m_shards.size()) {
+                Shard &shard = *m_shards[index];
+                std::unique_lock<std::mutex> locker(shard.mtx);
+                timer = shard.slab.find(timer_id);
+                if (timer != nullptr && !timer->cancelled.load(std::memory_order_relaxed)) {
+                    // The callback won't start any more; run_loop unlinks and releases the timer.
+                    timer->cancelled.store(true, std::memory_order_relaxed);
+                    shard.deleted++;
+                    submit(shard, Submission{timer, timer->gen, Submission::cancel});
+                    return 0;
+                }
             }
 
-            auto timer = m_mapTimers[timer_id];
-            m_QTimers.remove(timer);
-            m_mapTimers.erase(timer_id);
-            timer = nullptr;
+            std::cout << "delete_timer(),can't find timer = " << timer_id << std::endl;
             return 0;
         }
 
         virtual size_t count() override {
-            return m_QTimers.size();
+            size_t n = 0;
+            for (auto &shard : m_shards) {
+                std::unique_lock<std::mutex> locker(shard->mtx);
+                n += shard->slab.size() - shard->deleted;
+            }
+            return n;
+        }
+
+        virtual TimerQueueStats stats() override {
+            TimerQueueStats out;
+            out.fired = m_nFired.load(std::memory_order_relaxed);
+            out.late = m_nLate.load(std::memory_order_relaxed);
+            out.missed = m_nMissed.load(std::memory_order_relaxed);
+            m_error.snapshot(out.error);
+            out.wakeups = m_nWakeups.load(std::memory_order_relaxed);
+
+            std::unique_lock<std::mutex> locker(m_statLock);
+            uint64_t now = gettime_nsec();
+            out.wakeups_per_sec = now > m_nStatTime ? (double) (out.wakeups - m_nStatWakeups) * 1e9 / (now - m_nStatTime) : 0;
+            m_nStatWakeups = out.wakeups;
+            m_nStatTime = now;
+            return out;
         }
 
         virtual int run_loop() override {
+            apply_thread_options_or_warn(m_options.thread);
             m_isRunning = true;
             while (m_isRunning)
             {
-                auto timeNow = gettime_msec();
-                m_mLock.lock();
-                if (m_mapTimers.size() == 0)
-                {
-                    m_mLock.unlock();
-                    msleep(1);
-                    continue;
-                }
+                merge();
 
-                uint64_t timer_id;
-                auto timer = m_QTimers.top();
-                timer_id = timer->start_id;
-                if (timeNow < timer->timeout)
+                uint64_t deadline = m_schedule.empty() ? UINT64_MAX : m_schedule.next_deadline();
+                auto timeNow = gettime_nsec();
+                if (timeNow >= deadline)
                 {
-                    m_mLock.unlock();
-                    msleep(1); //sleep 1 million second
+                    m_schedule.expire(timeNow, [this](Timer *timer) {
+                        timer->firing = true;
+                        m_ready.push_back(timer);
+                    });
+                    for (Timer *timer : m_ready) {
+                        dispatch(timer);
+                    }
+                    m_ready.clear();
                     continue;
                 }
 
-                m_mLock.unlock();
-
-                if (timer->lamdaCb != nullptr) {
-                    timer->lamdaCb();
-                }
-
-                m_mLock.lock();
-
-                if (m_mapTimers.find(timer_id) != m_mapTimers.end()) {
-
-                    if (timer->repeat) {
-                        // repeated timer
-                        timer->timeout += timer->delay_msec;
-                        m_QTimers.push(timer);
+                // Spin through the last stretch rather than count on the scheduler waking us in time.
+                uint64_t spin = (uint64_t) m_options.spin.count();
+                if (deadline - timeNow <= spin) {
+                    // Still minding stop() and new submissions, one may be for an earlier deadline.
+                    while (m_isRunning && !dirty() && gettime_nsec() < deadline) {
                     }
-                    else {
-                        // oneshot timer
-                        m_mapTimers.erase(timer_id);
+                    continue;
+                }
+                uint64_t wakeup = deadline == UINT64_MAX ? deadline : deadline - spin;
+
+                // Pairs with create_timer: either it sees the new m_nWakeup and kicks, or this sees its submission.
+#if defined(__linux__)
+                if (m_sleeper) {
+                    m_nWakeup.store(deadline);
+                    if (m_isRunning && !dirty()) {
+                        m_sleeper->sleep_until(wakeup);
+                        m_nWakeups.fetch_add(1, std::memory_order_relaxed);
                     }
+                    m_nWakeup.store(0);
+                    continue;
                 }
-                else {
-                    // timer is deleted, not existed any more.
+#endif
+                std::unique_lock<std::mutex> locker(m_mLock);
+                m_nWakeup.store(deadline);
+                if (!m_bKick && m_isRunning && !dirty()) {
+                    if (wakeup == UINT64_MAX) {
+                        m_cond.wait(locker);
+                    } else {
+                        // Woken early by an earlier timer or stop(), either way look again.
+                        m_cond.wait_until(locker, std::chrono::steady_clock::time_point(
+                                std::chrono::nanoseconds(wakeup)));
+                    }
+                    m_nWakeups.fetch_add(1, std::memory_order_relaxed);
                 }
-
-                m_mLock.unlock();
+                m_bKick = false;
+                m_nWakeup.store(0);
             }
             std::cout << "rtc_timer_queue(%p) exit!" << std::endl;
             m_stopped = true;
@@ -179,12 +552,207 @@ namespace osu {
 
         virtual int stop() override {
             m_isRunning = false;
+            kick();
             return 0;
         }
+
+    private:
+        // Under the shard lock.
+        void submit(Shard &shard, Submission submission) {
+            shard.pending.push_back(submission);
+            if (!shard.dirty.load(std::memory_order_relaxed)) {
+                shard.dirty.store(true);
+            }
+        }
+
+        void kick() {
+#if defined(__linux__)
+            if (m_sleeper) {
+                m_sleeper->wake();
+                return;
+            }
+#endif
+            std::unique_lock<std::mutex> locker(m_mLock);
+            m_bKick = true;
+            m_cond.notify_one();
+        }
+
+        bool dirty() const {
+            for (auto &shard : m_shards) {
+                if (shard->dirty.load()) return true;
+            }
+            return false;
+        }
+
+        // Takes every shard's batch in one swap, then applies it without the shard lock.
+        void merge() {
+            for (auto &shard : m_shards) {
+                if (!shard->dirty.load()) continue;
+                {
+                    std::unique_lock<std::mutex> locker(shard->mtx);
+                    std::swap(shard->pending, m_merging);
+                    shard->dirty.store(false, std::memory_order_relaxed);
+                }
+
+                for (auto &submission : m_merging) {
+                    Timer *timer = submission.timer;
+                    switch (submission.kind) {
+                        case Submission::arm:
+                            m_schedule.insert(timer);
+                            break;
+                        case Submission::cancel:
+                            // Released already, or queued for release by a done earlier in the batch, or
+                            // firing, in which case it goes once the callback returned.
+                            if (timer->gen == submission.gen && !timer->firing && !timer->released &&
+                                timer->link.linked()) {
+                                m_schedule.remove(timer);
+                                timer->released = true;
+                                m_released.push_back(timer);
+                            }
+                            break;
+                        case Submission::done:
+                            complete(timer);
+                            break;
+                    }
+                }
+                m_merging.clear();
+                release_all(*shard);
+            }
+        }
+
+        void release_all(Shard &shard) {
+            if (m_released.empty()) return;
+            // Dropped outside the lock, a closure's destructor may well create or delete a timer.
+            for (Timer *timer : m_released) {
+                timer->lamdaCb = nullptr;
+            }
+            std::unique_lock<std::mutex> locker(shard.mtx);
+            for (Timer *timer : m_released) {
+                if (timer->cancelled.load(std::memory_order_relaxed)) {
+                    shard.deleted--;
+                }
+                shard.slab.release(timer);
+            }
+            m_released.clear();
+        }
+
+        void dispatch(Timer *timer) {
+            if (timer->cancelled.load(std::memory_order_relaxed) || !timer->lamdaCb) {
+                complete(timer);
+                release_all(*m_shards[timer->shard]);
+                return;
+            }
+
+            uint64_t now = gettime_nsec();
+            m_error.record(now > timer->deadline ? now - timer->deadline : 0);
+            if (m_options.callback_queue) {
+                {
+                    std::unique_lock<std::mutex> locker(m_mLock);
+                    m_nInflight++;
+                }
+                m_options.callback_queue->dispatch_async(CallbackTask(this, timer));
+            } else {
+                fire(timer);
+                complete(timer);
+                release_all(*m_shards[timer->shard]);
+            }
+        }
+
+        // Posted to callback_queue. Shed by a bounded queue before it ran, it still hands the timer back,
+        // as if the callback had been skipped, or the destructor would wait for it forever.
+        struct CallbackTask {
+            TimerQueueImpl *impl;
+            Timer *timer;
+
+            CallbackTask(TimerQueueImpl *impl, Timer *timer) : impl(impl), timer(timer) {}
+
+            CallbackTask(CallbackTask &&other) noexcept : impl(other.impl), timer(other.timer) {
+                other.impl = nullptr;
+            }
+
+            ~CallbackTask() {
+                if (impl != nullptr) {
+                    impl->returned(timer);
+                }
+            }
+
+            void operator()() {
+                TimerQueueImpl *owner = impl;
+                impl = nullptr;
+                owner->fire(timer);
+                owner->returned(timer);
+            }
+        };
+
+        // A callback run on callback_queue returned, or was shed.
+        void returned(Timer *timer) {
+            // Read before handing the timer back, run_loop may release it right after.
+            bool repeat = timer->repeat != 0;
+            uint64_t next = timer->deadline + timer->period + timer->slack;
+            {
+                Shard &shard = *m_shards[timer->shard];
+                std::unique_lock<std::mutex> locker(shard.mtx);
+                submit(shard, Submission{timer, timer->gen, Submission::done});
+            }
+            if (repeat && next < m_nWakeup.load()) {
+                kick();
+            }
+            std::unique_lock<std::mutex> locker(m_mLock);
+            if (--m_nInflight == 0) {
+                m_idle.notify_all();
+            }
+        }
+
+        // Runs the callback. Nobody else touches the closure while the timer is firing.
+        void fire(Timer *timer) {
+            uint64_t start = gettime_nsec();
+            if (start > timer->deadline + timer->slack + (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    m_options.late_threshold).count()) {
+                m_nLate.fetch_add(1, std::memory_order_relaxed);
+            }
+            m_nFired.fetch_add(1, std::memory_order_relaxed);
+            timer->lamdaCb();
+        }
+
+        // Once the callback returned, or was skipped: re-arms a repeating timer on its grid, queues the
+        // rest for release.
+        void complete(Timer *timer) {
+            timer->firing = false;
+            if (!timer->repeat || timer->cancelled.load(std::memory_order_relaxed)) {
+                // oneshot timer, or deleted meanwhile
+                timer->released = true;
+                m_released.push_back(timer);
+                return;
+            }
+
+            uint64_t period = std::max<uint64_t>(1, timer->period);
+            uint64_t next = timer->deadline + period;
+            uint64_t now = gettime_nsec();
+            if (next <= now && m_options.missed_ticks != TimerMissedTicks::fire_all) {
+                // Deadlines in [next, now], all passed without a callback of their own.
+                uint64_t passed = (now - next) / period + 1;
+                if (m_options.missed_ticks == TimerMissedTicks::coalesce) {
+                    next += (passed - 1) * period;
+                    m_nMissed.fetch_add(passed - 1, std::memory_order_relaxed);
+                } else {
+                    next += passed * period;
+                    m_nMissed.fetch_add(passed, std::memory_order_relaxed);
+                }
+            }
+            timer->deadline = next;
+            m_schedule.insert(timer);
+        }
     };
 
     std::shared_ptr<TimerQueue> TimerQueue::create() {
-        return std::make_shared<TimerQueueImpl>();
+        return create(TimerQueueOptions());
+    }
+
+    std::shared_ptr<TimerQueue> TimerQueue::create(TimerQueueOptions const &options) {
+        if (options.backend == TimerBackend::wheel) {
+            return std::make_shared<TimerQueueImpl<TimerWheelSchedule>>(options);
+        }
+        return std::make_shared<TimerQueueImpl<TimerHeapSchedule>>(options);
     }
 
 
@@ -6,25 +6,98 @@
 #define OSU_TIMER_H
 
 #include "osu.h"
+#include "osu_dispatch_queue.h"
 
 namespace osu {
 
     uint64_t gettime_sec();
     uint64_t gettime_msec();
     uint64_t gettime_usec();
+    uint64_t gettime_nsec();
     void msleep(int msec);
     void usleep(int usec);
 
+    // How a TimerQueue keeps its timers.
+    enum class TimerBackend {
+        // 4-ary heap: exact deadlines, O(log n) create_timer and delete_timer.
+        heap,
+        // Hierarchical timing wheel: O(1) create_timer and delete_timer at any count, deadlines rounded
+        // up to the tick. For many long timers that are mostly re-armed or deleted before they fire.
+        wheel
+    };
+
+    // What a repeating timer does about deadlines that passed while it could not fire, because its
+    // previous callback ran long or the loop was held up. Deadlines stay on the grid of the first one
+    // plus multiples of the period whatever the policy.
+    enum class TimerMissedTicks {
+        // Fire once for every deadline, back to back until caught up.
+        fire_all,
+        // Fire once now for all of them, then carry on with the next deadline.
+        coalesce,
+        // Drop them and wait for the next deadline still ahead.
+        skip
+    };
+
+    struct TimerQueueOptions {
+        // Applied to the thread calling run_loop.
+        ThreadOptions thread;
+        TimerBackend backend = TimerBackend::heap;
+        // Resolution of the wheel backend, a timer fires up to one tick late.
+        std::chrono::microseconds tick{1000};
+        // Callbacks run as tasks of this queue rather than on the run_loop thread, so a slow one holds up
+        // no other timer. A timer still has one callback running at a time. The TimerQueue must be
+        // destroyed outside its callbacks, it waits for the ones under way. A callback the queue sheds
+        // is skipped.
+        std::shared_ptr<DispatchQueue> callback_queue;
+        TimerMissedTicks missed_ticks = TimerMissedTicks::fire_all;
+        // A callback starting later than this after its deadline, plus slack, counts as late.
+        std::chrono::microseconds late_threshold{1000};
+        // create_timer and delete_timer go through per-thread shards that run_loop merges in batches,
+        // so threads arming timers neither contend with each other nor hold up the loop.
+        // <= 0 means one per core, at most 256.
+        int shards = 0;
+        // Sleep on a timerfd armed for the exact deadline (Linux) rather than a condition variable.
+        bool high_resolution = false;
+        // Wake this much before a deadline and busy-wait the rest, trading a core for less scheduler latency.
+        // Worth a few tens of microseconds on a host whose firing error is dominated by wakeup latency.
+        std::chrono::nanoseconds spin{0};
+    };
+
+    struct TimerQueueStats {
+        uint64_t fired;
+        // Fired, but started later than late_threshold past deadline plus slack.
+        uint64_t late;
+        // Deadlines of repeating timers that got no callback of their own (coalesce, skip).
+        uint64_t missed;
+        // Nanoseconds from deadline to the callback starting, or to it being posted with callback_queue.
+        // Slack a timer was given counts in.
+        HistogramSnapshot error;
+        // Times run_loop woke up, and the rate since the previous stats() call.
+        uint64_t wakeups;
+        double wakeups_per_sec;
+    };
+
     class TimerQueue {
     public:
         static std::shared_ptr<TimerQueue> create();
+        static std::shared_ptr<TimerQueue> create(TimerQueueOptions const &options);
         virtual ~TimerQueue() {
             std::cout << "TimerQueue dtor" << std::endl;
         };
 
-        virtual int create_timer(uint32_t delay_msec, std::function<void()> func, int repeat, uint64_t *p_timer_id) = 0;
+        // Allocates nothing once the queue has held as many timers before.
+        virtual int create_timer(uint32_t delay_msec, Closure func, int repeat, uint64_t *p_timer_id) = 0;
+        // Nanosecond delay (and period when repeat is set). How close it fires depends on high_resolution and spin.
+        virtual int create_timer(std::chrono::nanoseconds delay, Closure func, int repeat, uint64_t *p_timer_id) = 0;
+        // With slack the timer may fire anywhere up to slack after its deadline. The loop picks the instant in
+        // that window other timers are likely to pick too, and fires whatever is due at once, so timers
+        // with overlapping windows share a wakeup. Repeats keep to the deadline grid.
+        virtual int create_timer(std::chrono::nanoseconds delay, std::chrono::nanoseconds slack, Closure func,
+                                 int repeat, uint64_t *p_timer_id) = 0;
+        // An id stops resolving once its timer fired (one-shot) or was deleted, so a late delete is harmless.
         virtual int delete_timer(uint64_t timer_id) = 0;
         virtual size_t count() = 0;
+        virtual TimerQueueStats stats() = 0;
         virtual int run_loop() = 0;
         virtual int stop() = 0;
     };
@@ -0,0 +1,189 @@
+#include "osu.h"
+#include <random>
+#include <vector>
+
+static double ns_per(uint64_t start_us, size_t ops)
+{
+    return ops == 0 ? 0 : (double) (osu::gettime_usec() - start_us) * 1000 / ops;
+}
+
+// Connection-style timers: live timers 60-120 s out, re-armed (deleted and created again) long
+// before they fire, then a burst of short timers that do fire.
+static void run(const char *name, osu::TimerBackend backend, size_t live, size_t rearms, size_t fires)
+{
+    osu::TimerQueueOptions options;
+    options.backend = backend;
+    auto queue = osu::TimerQueue::create(options);
+    std::thread loop([&] { queue->run_loop(); });
+    std::mt19937 rng(7);
+
+    std::vector<uint64_t> ids(live);
+    uint64_t start = osu::gettime_usec();
+    for (auto &id : ids) {
+        queue->create_timer(60000 + rng() % 60000, [] {}, 0, &id);
+    }
+    double create_ns = ns_per(start, live);
+
+    start = osu::gettime_usec();
+    for (size_t i = 0; i < rearms; ++i) {
+        auto &id = ids[rng() % live];
+        queue->delete_timer(id);
+        queue->create_timer(60000 + rng() % 60000, [] {}, 0, &id);
+    }
+    double rearm_ns = ns_per(start, rearms);
+
+    std::atomic<size_t> fired(0);
+    start = osu::gettime_usec();
+    for (size_t i = 0; i < fires; ++i) {
+        uint64_t id;
+        queue->create_timer(1 + i % 100, [&fired] { fired++; }, 0, &id);
+    }
+    while (fired < fires) {
+        osu::msleep(1);
+    }
+    double fire_ns = ns_per(start, fires);
+
+    start = osu::gettime_usec();
+    for (auto id : ids) {
+        queue->delete_timer(id);
+    }
+    double delete_ns = ns_per(start, live);
+
+    printf("%-5s live=%9zu  create=%6.0f ns  rearm=%6.0f ns  delete=%6.0f ns  arm+fire=%6.0f ns\n",
+           name, live, create_ns, rearm_ns, delete_ns, fire_ns);
+    queue->stop();
+    loop.join();
+}
+
+// Every thread arms and deletes timers as fast as it can while the loop keeps firing a 1 ms timer.
+static void run_threads(int shards, int threads, size_t ops)
+{
+    osu::TimerQueueOptions options;
+    options.shards = shards;
+    auto queue = osu::TimerQueue::create(options);
+    std::thread loop([&] { queue->run_loop(); });
+    std::atomic<size_t> ticks(0);
+    uint64_t tick_id;
+    queue->create_timer(1, [&ticks] { ticks++; }, 1, &tick_id);
+
+    uint64_t start = osu::gettime_usec();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&queue, ops] {
+            uint64_t id;
+            for (size_t i = 0; i < ops; ++i) {
+                queue->create_timer(1000 + i % 1000, [] {}, 0, &id);
+                queue->delete_timer(id);
+            }
+        });
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    double secs = (double) (osu::gettime_usec() - start) / 1e6;
+
+    printf("shards=%3d threads=%2d  %6.2f M arm+delete/s  loop ticks=%zu in %.0f ms\n",
+           shards, threads, threads * ops / secs / 1e6, ticks.load(), secs * 1e3);
+    queue->stop();
+    loop.join();
+}
+
+// A 250 us repeating timer, firing error as the queue measured it.
+static void run_precision(const char *name, bool high_resolution, std::chrono::nanoseconds spin, size_t fires)
+{
+    osu::TimerQueueOptions options;
+    options.high_resolution = high_resolution;
+    options.spin = spin;
+    auto queue = osu::TimerQueue::create(options);
+    std::thread loop([&] { queue->run_loop(); });
+
+    std::atomic<size_t> fired(0);
+    uint64_t id;
+    queue->create_timer(std::chrono::microseconds(250), [&fired] { fired++; }, 1, &id);
+    while (fired < fires) {
+        osu::msleep(1);
+    }
+    queue->delete_timer(id);
+
+    auto error = queue->stats().error;
+    printf("%-18s fires=%zu  error p50=%6.1f us  p99=%6.1f us  p99.9=%6.1f us  max=%7.1f us\n",
+           name, (size_t) error.count, error.percentile(50) / 1e3, error.percentile(99) / 1e3,
+           error.percentile(99.9) / 1e3, error.max / 1e3);
+    queue->stop();
+    loop.join();
+}
+
+// Periodic timers with periods spread over 10-11 ms, with and without slack to share wakeups in.
+static void run_slack(std::chrono::nanoseconds slack, size_t timers)
+{
+    auto queue = osu::TimerQueue::create();
+    std::thread loop([&] { queue->run_loop(); });
+    std::atomic<size_t> fired(0);
+    std::vector<uint64_t> ids(timers);
+    for (size_t i = 0; i < timers; ++i) {
+        auto period = std::chrono::microseconds(10000 + (i * 7919) % 1000);
+        queue->create_timer(period, slack, [&fired] { fired++; }, 1, &ids[i]);
+    }
+
+    osu::msleep(100);
+    queue->stats();
+    fired = 0;
+    osu::msleep(1000);
+    auto stats = queue->stats();
+    printf("slack=%5.1f ms timers=%zu  fires/s=%7zu  wakeups/s=%6.0f  error p50=%6.1f us  p99=%6.1f us\n",
+           slack.count() / 1e6, timers, fired.load(), stats.wakeups_per_sec,
+           stats.error.percentile(50) / 1e3, stats.error.percentile(99) / 1e3);
+
+    for (auto id : ids) {
+        queue->delete_timer(id);
+    }
+    queue->stop();
+    loop.join();
+}
+
+int main(int argc, char *argv[])
+{
+    osu::CommandLineParser parser(argc, argv);
+    parser.SetFlag("live", "10000,1000000,10000000", "comma separated live timer counts");
+    parser.SetFlag("rearms", "1000000", "timers re-armed at each count");
+    parser.SetFlag("fires", "100000", "short timers armed and fired at each count");
+    parser.SetFlag("arms", "200000", "timers armed and deleted by every thread in the contention runs");
+    parser.SetFlag("precision", "4000", "fires of the 250us timer in the precision runs");
+    parser.SetFlag("periodic", "2000", "periodic timers in the slack runs");
+    parser.ProcessFlags();
+    size_t rearms = (size_t) atol(parser.GetFlag("rearms").c_str());
+    size_t fires = (size_t) atol(parser.GetFlag("fires").c_str());
+    size_t arms = (size_t) atol(parser.GetFlag("arms").c_str());
+    size_t precision = (size_t) atol(parser.GetFlag("precision").c_str());
+    size_t periodic = (size_t) atol(parser.GetFlag("periodic").c_str());
+
+    std::string live = parser.GetFlag("live");
+    const char *p = live.c_str();
+    while (*p != '\0') {
+        char *end;
+        size_t n = (size_t) strtoull(p, &end, 10);
+        if (end == p) break;
+        if (n > 0) {
+            run("heap", osu::TimerBackend::heap, n, rearms, fires);
+            run("wheel", osu::TimerBackend::wheel, n, rearms, fires);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    // One shard is close to the single lock the queue used to have.
+    int cores = std::max(1, (int) std::thread::hardware_concurrency());
+    for (int threads = 1; threads <= std::max(4, cores); threads *= 2) {
+        run_threads(1, threads, arms);
+        run_threads(0, threads, arms);
+    }
+
+    run_precision("condvar", false, std::chrono::nanoseconds(0), precision);
+    run_precision("timerfd", true, std::chrono::nanoseconds(0), precision);
+    run_precision("timerfd+spin 50us", true, std::chrono::microseconds(50), precision);
+
+    for (int slack_ms : {0, 1, 4}) {
+        run_slack(std::chrono::milliseconds(slack_ms), periodic);
+    }
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+#ifndef PROJECT_OSU_TIMER_HEAP_H
+#define PROJECT_OSU_TIMER_HEAP_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace osu {
+
+    // Link embedded in whatever a TimerHeap schedules, recover the owner with OSU_CONTAINER_OF.
+    struct TimerHeapNode {
+        static const uint32_t npos = UINT32_MAX;
+
+        // Absolute time the node is due at, in whatever unit the owner picks.
+        uint64_t expiry = 0;
+        // Position in the heap while linked, so removing it needs no search.
+        uint32_t index = npos;
+
+        bool linked() const {
+            return index != npos;
+        }
+    };
+
+    // Indexed 4-ary min-heap ordered by expiry. insert, remove and pop are O(log n); a node knows
+    // its slot, so remove is a sift from there rather than a search. The array holds the expiry next
+    // to the node pointer, so sifting compares without touching the nodes.
+    // Not thread safe.
+    class TimerHeap {
+    public:
+        static const unsigned arity = 4;
+        static const uint64_t never = UINT64_MAX;
+
+        TimerHeap() {}
+
+        TimerHeap(TimerHeap const &) = delete;
+
+        TimerHeap &operator=(TimerHeap const &) = delete;
+
+        size_t size() const {
+            return heap_.size();
+        }
+
+        bool empty() const {
+            return heap_.empty();
+        }
+
+        // Earliest expiry, never when empty.
+        uint64_t next_expiry() const {
+            return heap_.empty() ? never : heap_[0].expiry;
+        }
+
+        TimerHeapNode *top() const {
+            return heap_.empty() ? nullptr : heap_[0].node;
+        }
+
+        // node->expiry must be set and node not linked.
+        void insert(TimerHeapNode *node) {
+            assert(!node->linked());
+            heap_.push_back(entry{node->expiry, node});
+            sift_up((uint32_t) heap_.size() - 1);
+        }
+
+        // node must be linked; removing one that is not is a bug caught by the assert, a no-op under NDEBUG.
+        void remove(TimerHeapNode *node) {
+            assert(node->linked() && node->index < heap_.size() && heap_[node->index].node == node);
+            if (!node->linked()) {
+                return;
+            }
+            uint32_t i = node->index;
+            uint32_t last = (uint32_t) heap_.size() - 1;
+            node->index = TimerHeapNode::npos;
+            if (i != last) {
+                heap_[i] = heap_[last];
+                heap_[i].node->index = i;
+                heap_.pop_back();
+                if (i > 0 && heap_[i].expiry < heap_[parent(i)].expiry) {
+                    sift_up(i);
+                } else {
+                    sift_down(i);
+                }
+            } else {
+                heap_.pop_back();
+            }
+        }
+
+        TimerHeapNode *pop() {
+            TimerHeapNode *node = top();
+            if (node != nullptr) {
+                remove(node);
+            }
+            return node;
+        }
+
+        // Keeps the storage, so a heap that grew once inserts without allocating.
+        void clear() {
+            for (auto &e : heap_) {
+                e.node->index = TimerHeapNode::npos;
+            }
+            heap_.clear();
+        }
+
+    private:
+        struct entry {
+            uint64_t expiry;
+            TimerHeapNode *node;
+        };
+
+        static uint32_t parent(uint32_t i) {
+            return (i - 1) / arity;
+        }
+
+        void sift_up(uint32_t i) {
+            entry moving = heap_[i];
+            while (i > 0) {
+                uint32_t p = parent(i);
+                if (!(moving.expiry < heap_[p].expiry)) break;
+                heap_[i] = heap_[p];
+                heap_[i].node->index = i;
+                i = p;
+            }
+            heap_[i] = moving;
+            moving.node->index = i;
+        }
+
+        void sift_down(uint32_t i) {
+            uint32_t n = (uint32_t) heap_.size();
+            entry moving = heap_[i];
+            while (true) {
+                uint32_t first = i * arity + 1;
+                if (first >= n) break;
+                uint32_t best = first;
+                uint32_t end = first + arity < n ? first + arity : n;
+                for (uint32_t c = first + 1; c < end; ++c) {
+                    if (heap_[c].expiry < heap_[best].expiry) best = c;
+                }
+                if (!(heap_[best].expiry < moving.expiry)) break;
+                heap_[i] = heap_[best];
+                heap_[i].node->index = i;
+                i = best;
+            }
+            heap_[i] = moving;
+            moving.node->index = i;
+        }
+
+        std::vector<entry> heap_;
+    };
+}
+
+#endif //PROJECT_OSU_TIMER_HEAP_H
@@ -3,19 +3,661 @@
 //
 
 #include "osu.h"
+#include "osu_timer_heap.h"
+#include "osu_timing_wheel.h"
+#include <random>
+#include <vector>
+#if defined(__linux__)
+#include <sys/resource.h>
+#endif
 
-int main(int argc, char *argv[])
+// Runs the queue's loop for the duration of fn.
+static void with_queue(osu::TimerQueueOptions const &options, std::function<void(osu::TimerQueue &)> fn)
+{
+    auto queue = osu::TimerQueue::create(options);
+    std::thread loop([&queue] { queue->run_loop(); });
+    fn(*queue);
+    queue->stop();
+    loop.join();
+}
+
+// Polls done for up to 5 s.
+static bool wait_for(std::function<bool()> done)
+{
+    for (int i = 0; i < 5000 && !done(); ++i) {
+        osu::msleep(1);
+    }
+    return done();
+}
+
+// Voluntary context switches of the process so far, 0 where they are not counted.
+static long context_switches()
+{
+#if defined(__linux__)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw;
+#else
+    return 0;
+#endif
+}
+
+// The loop sleeps rather than polls, with no timer and with one far off.
+static void test_loop_idle()
+{
+    with_queue(osu::TimerQueueOptions(), [](osu::TimerQueue &queue) {
+        for (bool armed : {false, true}) {
+            uint64_t id;
+            if (armed) queue.create_timer(10000, [] {}, 0, &id);
+            osu::msleep(20);
+            long before = context_switches();
+            osu::msleep(200);
+            // The msleep is one, polling every millisecond would be about 200.
+            assert(context_switches() - before < 20);
+            if (armed) queue.delete_timer(id);
+        }
+    });
+}
+
+// A timer due before the one the loop sleeps for cuts the sleep short.
+static void test_loop_earlier_timer()
+{
+    std::atomic<uint64_t> fired_at(0);
+    with_queue(osu::TimerQueueOptions(), [&](osu::TimerQueue &queue) {
+        uint64_t far, near;
+        queue.create_timer(10000, [] {}, 0, &far);
+        osu::msleep(20);
+        uint64_t start = osu::gettime_msec();
+        queue.create_timer(10, [&fired_at] { fired_at = osu::gettime_msec(); }, 0, &near);
+        bool fired = wait_for([&] { return fired_at != 0; });
+        assert(fired);
+        assert(fired_at >= start + 10 && fired_at < start + 1000);
+        queue.delete_timer(far);
+    });
+}
+
+// stop() wakes a loop asleep for the first timer or for a far one.
+static void test_loop_stop()
+{
+    for (bool armed : {false, true}) {
+        auto queue = osu::TimerQueue::create();
+        std::thread loop([&queue] { queue->run_loop(); });
+        uint64_t id;
+        if (armed) queue->create_timer(10000, [] {}, 0, &id);
+        osu::msleep(20);
+        uint64_t start = osu::gettime_msec();
+        queue->stop();
+        loop.join();
+        assert(osu::gettime_msec() - start < 1000);
+    }
+}
+
+static osu::TimerHeapNode *at_index(std::vector<osu::TimerHeapNode> &nodes, uint32_t index)
+{
+    for (auto &node : nodes) {
+        if (node.index == index) return &node;
+    }
+    return nullptr;
+}
+
+static void test_heap_order()
+{
+    std::vector<osu::TimerHeapNode> nodes(1000);
+    osu::TimerHeap heap;
+    std::mt19937 rng(1);
+    for (auto &node : nodes) {
+        // Plenty of equal expiries.
+        node.expiry = rng() % 300;
+        heap.insert(&node);
+    }
+    assert(heap.size() == nodes.size());
+
+    uint64_t last = 0;
+    size_t popped = 0;
+    while (osu::TimerHeapNode *node = heap.pop()) {
+        assert(node->expiry >= last);
+        assert(!node->linked());
+        last = node->expiry;
+        popped++;
+    }
+    assert(popped == nodes.size());
+    assert(heap.empty() && heap.next_expiry() == osu::TimerHeap::never);
+}
+
+static void test_heap_remove()
+{
+    std::vector<osu::TimerHeapNode> nodes(100);
+    osu::TimerHeap heap;
+    std::mt19937 rng(2);
+    for (auto &node : nodes) {
+        node.expiry = rng() % 1000;
+        heap.insert(&node);
+    }
+
+    // From the middle, which moves the last entry into the hole, and from the last slot, which moves nothing.
+    osu::TimerHeapNode *middle = at_index(nodes, (uint32_t) heap.size() / 2);
+    heap.remove(middle);
+    assert(!middle->linked());
+    osu::TimerHeapNode *last = at_index(nodes, (uint32_t) heap.size() - 1);
+    heap.remove(last);
+    assert(!last->linked());
+    osu::TimerHeapNode *top = heap.top();
+    heap.remove(top);
+    assert(heap.size() == nodes.size() - 3);
+
+    uint64_t prev = 0;
+    while (osu::TimerHeapNode *node = heap.pop()) {
+        assert(node != middle && node != last && node != top);
+        assert(node->expiry >= prev);
+        prev = node->expiry;
+    }
+
+    // A removed node can go back in.
+    heap.insert(middle);
+    assert(heap.top() == middle && heap.size() == 1);
+    heap.clear();
+    assert(!middle->linked());
+}
+
+// The slot of a fired one-shot is reused; deleting by the old id must leave the new timer alone.
+static void test_stale_id(osu::TimerBackend backend)
+{
+    osu::TimerQueueOptions options;
+    options.backend = backend;
+    std::atomic<int> fired(0);
+    with_queue(options, [&](osu::TimerQueue &queue) {
+        uint64_t first, second;
+        queue.create_timer(0, [&fired] { fired++; }, 0, &first);
+        bool released = wait_for([&] { return fired == 1 && queue.count() == 0; });
+        assert(released);
+
+        queue.create_timer(20, [&fired] { fired++; }, 0, &second);
+        assert((uint32_t) second == (uint32_t) first && second != first);
+        queue.delete_timer(first);
+        assert(queue.count() == 1);
+        bool fired_again = wait_for([&] { return fired == 2 && queue.count() == 0; });
+        assert(fired_again);
+    });
+}
+
+// Every node fires on the tick of its expiry, whichever level it was filed in and however far the
+// wheel jumps in one advance().
+static void test_wheel_cascade()
+{
+    const uint64_t expiries[] = {1, 63, 64, 65, 100, 4095, 4096, 4097, 300000, 1ull << 30,
+                                 osu::TimingWheel::range + 12345};
+    std::vector<osu::TimingWheelNode> nodes(sizeof(expiries) / sizeof(expiries[0]));
+    osu::TimingWheel wheel;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        nodes[i].expiry = expiries[i];
+        wheel.insert(&nodes[i]);
+    }
+
+    // Nothing is due before the earliest expiry.
+    size_t fired = 0;
+    wheel.advance(0, [&](osu::TimingWheelNode *) { fired++; });
+    assert(fired == 0);
+
+    uint64_t last = 0;
+    // Tick by tick through level 0 and the first cascades, then in jumps.
+    for (uint64_t to = 1; to <= 5000; ++to) {
+        wheel.advance(to, [&](osu::TimingWheelNode *node) {
+            assert(node->expiry == wheel.now() && node->expiry >= last);
+            last = node->expiry;
+            fired++;
+        });
+    }
+    assert(fired == 8);
+    wheel.advance(osu::TimingWheel::range * 2, [&](osu::TimingWheelNode *node) {
+        assert(node->expiry == wheel.now() && node->expiry >= last);
+        last = node->expiry;
+        fired++;
+    });
+    assert(fired == nodes.size() && wheel.empty());
+}
+
+static void test_wheel_remove()
+{
+    osu::TimingWheel wheel;
+    osu::TimingWheelNode level1, level2, level3, kept;
+    level1.expiry = 100;
+    level2.expiry = 5000;
+    level3.expiry = 300000;
+    kept.expiry = 6000;
+    for (auto *node : {&level1, &level2, &level3, &kept}) {
+        wheel.insert(node);
+    }
+
+    // Straight from their levels, and once a cascade moved them down.
+    wheel.remove(&level1);
+    wheel.advance(4096, [](osu::TimingWheelNode *) { assert(false); });
+    wheel.remove(&level2);
+    assert(!level1.linked() && !level2.linked() && wheel.size() == 2);
+
+    std::vector<osu::TimingWheelNode *> fired;
+    wheel.advance(6000, [&](osu::TimingWheelNode *node) { fired.push_back(node); });
+    assert(fired.size() == 1 && fired[0] == &kept);
+    wheel.remove(&level3);
+    assert(wheel.empty() && wheel.next_event() == osu::TimingWheel::never);
+    wheel.advance(osu::TimingWheel::range, [](osu::TimingWheelNode *) { assert(false); });
+}
+
+// Equal expiries share a slot and fire together in insertion order, straight from level 0 or after cascading.
+static void test_wheel_same_slot()
+{
+    osu::TimingWheel wheel;
+    std::vector<osu::TimingWheelNode> near(5), far(5);
+    for (auto &node : near) {
+        node.expiry = 10;
+        wheel.insert(&node);
+    }
+    for (auto &node : far) {
+        node.expiry = 5000;
+        wheel.insert(&node);
+    }
+
+    std::vector<osu::TimingWheelNode *> fired;
+    wheel.advance(10, [&](osu::TimingWheelNode *node) { fired.push_back(node); });
+    assert(fired.size() == near.size());
+    for (size_t i = 0; i < near.size(); ++i) {
+        assert(fired[i] == &near[i]);
+    }
+
+    fired.clear();
+    wheel.advance(4999, [&](osu::TimingWheelNode *node) { fired.push_back(node); });
+    assert(fired.empty());
+    wheel.advance(5000, [&](osu::TimingWheelNode *node) { fired.push_back(node); });
+    assert(fired.size() == far.size());
+    for (size_t i = 0; i < far.size(); ++i) {
+        assert(fired[i] == &far[i]);
+    }
+}
+
+// The wheel backend rounds deadlines up to the tick: never early, at most a tick late.
+static void test_wheel_rounding()
+{
+    osu::TimerQueueOptions options;
+    options.backend = osu::TimerBackend::wheel;
+    options.tick = std::chrono::milliseconds(5);
+    std::atomic<uint64_t> fired_at(0);
+    with_queue(options, [&](osu::TimerQueue &queue) {
+        for (uint32_t delay_ms : {1, 7, 12, 333}) {
+            fired_at = 0;
+            uint64_t id;
+            uint64_t start = osu::gettime_usec();
+            queue.create_timer(delay_ms, [&fired_at] { fired_at = osu::gettime_usec(); }, 0, &id);
+            bool fired = wait_for([&] { return fired_at != 0; });
+            assert(fired);
+            assert(fired_at >= start + delay_ms * 1000ull);
+            // A tick, plus room for a busy host.
+            assert(fired_at < start + (delay_ms + 5 + 50) * 1000ull);
+        }
+    });
+}
+
+// A 100 ms repeating timer whose first callback blocks 450 ms, so deadlines 2-5 pass while it runs and
+// deadline 6 is still 50 ms ahead when it returns. Each policy owes those four deadlines differently:
+// fire_all calls back for each at once, coalesce once, skip not at all, and stats().missed counts the rest.
+static void test_missed_ticks(osu::TimerMissedTicks policy, bool callback_queue)
+{
+    const uint64_t period_ms = 100;
+    size_t immediate = policy == osu::TimerMissedTicks::fire_all ? 4 : policy == osu::TimerMissedTicks::coalesce ? 1 : 0;
+
+    osu::TimerQueueOptions options;
+    options.missed_ticks = policy;
+    if (callback_queue) {
+        options.callback_queue = osu::DispatchQueue::concurrent(2);
+    }
+    // Outlives the queue, which waits for a callback still running on callback_queue.
+    std::mutex mtx;
+    std::vector<uint64_t> starts;
+    with_queue(options, [&](osu::TimerQueue &queue) {
+        uint64_t id;
+        uint64_t t0 = osu::gettime_usec();
+        queue.create_timer((uint32_t) period_ms, [&] {
+            size_t n;
+            {
+                std::unique_lock<std::mutex> locker(mtx);
+                starts.push_back(osu::gettime_usec());
+                n = starts.size();
+            }
+            if (n == 1) osu::msleep(450);
+        }, 1, &id);
+
+        auto callbacks = [&] {
+            std::unique_lock<std::mutex> locker(mtx);
+            return starts.size();
+        };
+        bool caught_up = wait_for([&] { return callbacks() >= immediate + 2; });
+        assert(caught_up);
+        queue.delete_timer(id);
+
+        std::unique_lock<std::mutex> locker(mtx);
+        for (size_t i = 1; i <= immediate; ++i) {
+            assert(starts[i] < t0 + 6 * period_ms * 1000);
+        }
+        assert(starts[immediate + 1] >= t0 + 6 * period_ms * 1000);
+        assert(queue.stats().missed == 4 - immediate);
+    });
+}
+
+// A callback shed by a full callback_queue is skipped: a repeating timer keeps its schedule and the
+// queue is not left waiting for it on the way out.
+static void test_shed_callbacks()
+{
+    osu::TimerQueueOptions options;
+    options.callback_queue = std::make_shared<osu::DispatchQueue>();
+    options.callback_queue->set_capacity(1, osu::DispatchOverflow::reject);
+    std::atomic<bool> gate(false), blocked(false);
+    options.callback_queue->dispatch_async([&] {
+        blocked = true;
+        while (!gate) osu::msleep(1);
+    });
+    while (!blocked) osu::msleep(1);
+    options.callback_queue->dispatch_async([] {});
+
+    std::atomic<int> fired(0);
+    with_queue(options, [&](osu::TimerQueue &queue) {
+        uint64_t id;
+        queue.create_timer((uint32_t) 5, [&fired] { fired++; }, 1, &id);
+        bool shed = wait_for([&] { return options.callback_queue->stats().rejected >= 3; });
+        assert(shed);
+    });
+    assert(fired == 0);
+    gate = true;
+    options.callback_queue->dispatch_flush();
+}
+
+// With callback_queue a slow callback overlaps the next deadlines, yet the timer's callbacks never overlap.
+static void test_one_callback_at_a_time()
+{
+    osu::TimerQueueOptions options;
+    options.callback_queue = osu::DispatchQueue::concurrent(4);
+    std::atomic<int> running(0);
+    std::atomic<int> calls(0);
+    std::atomic<bool> overlapped(false);
+    with_queue(options, [&](osu::TimerQueue &queue) {
+        uint64_t id;
+        queue.create_timer(1, [&] {
+            if (running.fetch_add(1) != 0) overlapped = true;
+            osu::msleep(5);
+            running--;
+            calls++;
+        }, 1, &id);
+        bool fired = wait_for([&] { return calls >= 20; });
+        assert(fired);
+        queue.delete_timer(id);
+        assert(!overlapped);
+    });
+}
+
+// A one-shot's done and its delete_timer land in the same batch, the timer must be released once.
+static void test_delete_after_fire(osu::TimerBackend backend)
 {
-    osu::CommandLineParser parser(argc, argv);
-    parser.ProcessFlags();
+    osu::TimerQueueOptions options;
+    options.backend = backend;
+    options.shards = 1;
+    // Else the wheel rounds every 0 ms timer up to a 1 ms tick.
+    options.tick = std::chrono::microseconds(1);
+    options.callback_queue = osu::DispatchQueue::concurrent(2);
+    std::atomic<int> fired(0);
+    with_queue(options, [&](osu::TimerQueue &queue) {
+        for (int i = 0; i < 20000; ++i) {
+            uint64_t id;
+            queue.create_timer(0, [&fired] { fired++; }, 0, &id);
+            while (fired == i) std::this_thread::yield();
+            queue.delete_timer(id);
+        }
+        bool released = wait_for([&] { return queue.count() == 0; });
+        assert(released);
+    });
+}
 
-    uint64_t timer_id;
-    osu::TimerQueuePtr timerQueuePtr = osu::TimerQueue::create();
-    timerQueuePtr->create_timer(1000, []{
-        std::cout << "triggerred:" << osu::gettime_sec() << std::endl;
-        std::cout << osu::format("time:%d", osu::gettime_sec()) << std::endl;
-    }, 1, &timer_id);
+// Arms another timer when destroyed.
+struct rearm_on_release {
+    osu::TimerQueue *queue;
+    std::atomic<int> *fired;
 
-    timerQueuePtr->run_loop();
+    rearm_on_release(osu::TimerQueue *queue, std::atomic<int> *fired) : queue(queue), fired(fired) {}
 
-}
\ No newline at end of file
+    rearm_on_release(rearm_on_release &&other) noexcept : queue(other.queue), fired(other.fired) {
+        other.queue = nullptr;
+    }
+
+    ~rearm_on_release() {
+        if (queue != nullptr) {
+            uint64_t id;
+            std::atomic<int> *count = fired;
+            queue->create_timer(0, [count] { (*count)++; }, 0, &id);
+        }
+    }
+
+    void operator()() {
+        (*fired)++;
+    }
+};
+
+// A closure released by the loop may create a timer in the same shard from its destructor.
+static void test_release_reentrant(osu::TimerBackend backend)
+{
+    osu::TimerQueueOptions options;
+    options.backend = backend;
+    options.shards = 1;
+    std::atomic<int> fired(0);
+    with_queue(options, [&](osu::TimerQueue &queue) {
+        uint64_t fires, deleted;
+        queue.create_timer(0, rearm_on_release(&queue, &fired), 0, &fires);
+        queue.create_timer(1000, rearm_on_release(&queue, &fired), 0, &deleted);
+        queue.delete_timer(deleted);
+        bool rearmed = wait_for([&] { return fired == 3; });
+        assert(rearmed);
+    });
+}
+
+// Threads create and delete one-shot and repeating timers, some before they fire, some right after,
+// while the loop fires the rest.
+static void test_threads(osu::TimerBackend backend, bool callback_queue)
+{
+    const int threads = 4;
+    osu::TimerQueueOptions options;
+    options.backend = backend;
+    if (callback_queue) {
+        options.callback_queue = osu::DispatchQueue::concurrent(2);
+    }
+    std::atomic<size_t> fired(0);
+    std::atomic<int> ran[threads];
+    for (auto &r : ran) r = 0;
+    with_queue(options, [&](osu::TimerQueue &queue) {
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                std::vector<uint64_t> ids;
+                for (int i = 0; i < 2000; ++i) {
+                    uint64_t id;
+                    switch (i % 4) {
+                        case 0:
+                            // Deleted right after it fired.
+                            queue.create_timer(0, [&ran, t] { ran[t]++; }, 0, &id);
+                            while (ran[t] == i / 4) std::this_thread::yield();
+                            queue.delete_timer(id);
+                            break;
+                        case 1:
+                            // Deleted before it fires.
+                            queue.create_timer(1000, [&fired] { fired++; }, 0, &id);
+                            queue.delete_timer(id);
+                            break;
+                        case 2:
+                            // Fires, and may or may not be deleted in time.
+                            queue.create_timer(i % 2, [&fired] { fired++; }, 0, &id);
+                            ids.push_back(id);
+                            break;
+                        case 3:
+                            // Repeating, fires a few times before it goes.
+                            queue.create_timer(1, [&fired] { fired++; }, 1, &id);
+                            ids.push_back(id);
+                            break;
+                    }
+                    if (ids.size() >= 16) {
+                        for (auto stale : ids) queue.delete_timer(stale);
+                        ids.clear();
+                    }
+                }
+                for (auto stale : ids) queue.delete_timer(stale);
+            });
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+        bool released = wait_for([&] { return queue.count() == 0; });
+        assert(released);
+    });
+    for (auto &r : ran) {
+        assert(r == 500);
+    }
+    assert(fired > 0);
+}
+
+// Nanosecond one-shots and a 250 us repeating timer never fire before their deadlines, whichever
+// way the loop sleeps.
+static void test_ns_deadlines(bool high_resolution, std::chrono::nanoseconds spin)
+{
+    osu::TimerQueueOptions options;
+    options.high_resolution = high_resolution;
+    options.spin = spin;
+    std::atomic<uint64_t> fired_at(0);
+    std::mutex mtx;
+    std::vector<uint64_t> starts;
+    with_queue(options, [&](osu::TimerQueue &queue) {
+        for (uint64_t delay : {1ull, 50000ull, 250333ull, 1000777ull, 3000001ull}) {
+            fired_at = 0;
+            uint64_t id;
+            uint64_t start = osu::gettime_nsec();
+            queue.create_timer(std::chrono::nanoseconds(delay), [&fired_at] { fired_at = osu::gettime_nsec(); }, 0,
+                               &id);
+            bool fired = wait_for([&] { return fired_at != 0; });
+            assert(fired);
+            assert(fired_at >= start + delay);
+        }
+
+        const uint64_t period = 250000;
+        uint64_t id;
+        uint64_t t0 = osu::gettime_nsec();
+        queue.create_timer(std::chrono::nanoseconds(period), [&] {
+            std::unique_lock<std::mutex> locker(mtx);
+            starts.push_back(osu::gettime_nsec());
+        }, 1, &id);
+        bool repeated = wait_for([&] {
+            std::unique_lock<std::mutex> locker(mtx);
+            return starts.size() >= 40;
+        });
+        assert(repeated);
+        queue.delete_timer(id);
+        std::unique_lock<std::mutex> locker(mtx);
+        for (size_t i = 0; i < starts.size(); ++i) {
+            assert(starts[i] >= t0 + (i + 1) * period);
+        }
+    });
+}
+
+// Spinning toward a far deadline, the loop still picks up an earlier timer, and stop().
+static void test_spin_interrupted()
+{
+    osu::TimerQueueOptions options;
+    options.high_resolution = true;
+    options.spin = std::chrono::seconds(2);
+    std::atomic<uint64_t> fired_at(0);
+    uint64_t stopping = 0;
+    with_queue(options, [&](osu::TimerQueue &queue) {
+        uint64_t far, near;
+        queue.create_timer(std::chrono::seconds(1), [] {}, 0, &far);
+        osu::msleep(20);
+        uint64_t start = osu::gettime_nsec();
+        queue.create_timer(std::chrono::milliseconds(1), [&fired_at] { fired_at = osu::gettime_nsec(); }, 0, &near);
+        bool fired = wait_for([&] { return fired_at != 0; });
+        assert(fired);
+        assert(fired_at - start < 500000000);
+        osu::msleep(20);
+        stopping = osu::gettime_msec();
+    });
+    assert(osu::gettime_msec() - stopping < 500);
+}
+
+// Eight timers 1 ms out with 5 ms slack, on windows that overlap. They are armed just after a multiple
+// of 8192 units (a unit is 1024 ns on the heap, the 1 us tick on the wheel), so every window holds
+// the same coalescing point, the multiple of 4096 between. All fire in the wakeup for it, each
+// callback sees the same stats().wakeups, and none after its deadline plus slack.
+static void test_slack_coalesce(osu::TimerBackend backend)
+{
+    const int timers = 8;
+    const uint64_t delay = 1000000, slack = 5000000;
+    osu::TimerQueueOptions options;
+    options.backend = backend;
+    options.tick = std::chrono::microseconds(1);
+    uint64_t unit = backend == osu::TimerBackend::wheel ? 1000 : 1024;
+    std::atomic<uint64_t> fired_at[timers], wakeups[timers];
+    for (int i = 0; i < timers; ++i) {
+        fired_at[i] = 0;
+    }
+    with_queue(options, [&](osu::TimerQueue &queue) {
+        while ((osu::gettime_nsec() / unit) % 8192 >= 200) {
+            std::this_thread::yield();
+        }
+        uint64_t start = osu::gettime_nsec();
+        for (int i = 0; i < timers; ++i) {
+            uint64_t id;
+            queue.create_timer(std::chrono::nanoseconds(delay + i * 20000), std::chrono::nanoseconds(slack),
+                               [&, i] {
+                                   fired_at[i] = osu::gettime_nsec();
+                                   wakeups[i] = queue.stats().wakeups;
+                               }, 0, &id);
+        }
+        bool fired = wait_for([&] {
+            for (auto &at : fired_at) {
+                if (at == 0) return false;
+            }
+            return true;
+        });
+        assert(fired);
+        for (int i = 0; i < timers; ++i) {
+            uint64_t deadline = start + delay + i * 20000;
+            assert(fired_at[i] >= deadline);
+            // Slack, plus the late threshold for a busy host.
+            assert(fired_at[i] < deadline + slack + 1000000);
+            assert(wakeups[i] == wakeups[0]);
+        }
+    });
+}
+
+int main(int argc, char *argv[])
+{
+    test_loop_idle();
+    test_loop_earlier_timer();
+    test_loop_stop();
+    test_heap_order();
+    test_heap_remove();
+    test_wheel_cascade();
+    test_wheel_remove();
+    test_wheel_same_slot();
+    test_wheel_rounding();
+    for (auto policy : {osu::TimerMissedTicks::fire_all, osu::TimerMissedTicks::coalesce,
+                        osu::TimerMissedTicks::skip}) {
+        test_missed_ticks(policy, false);
+        test_missed_ticks(policy, true);
+    }
+    test_one_callback_at_a_time();
+    test_shed_callbacks();
+    test_ns_deadlines(false, std::chrono::nanoseconds(0));
+    test_ns_deadlines(true, std::chrono::nanoseconds(0));
+    test_ns_deadlines(true, std::chrono::microseconds(50));
+    test_spin_interrupted();
+    for (auto backend : {osu::TimerBackend::heap, osu::TimerBackend::wheel}) {
+        test_stale_id(backend);
+        test_delete_after_fire(backend);
+        test_release_reentrant(backend);
+        test_threads(backend, false);
+        test_threads(backend, true);
+        test_slack_coalesce(backend);
+    }
+    std::cout << "osu_timer_unittest passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,187 @@
+#ifndef PROJECT_OSU_TIMING_WHEEL_H
+#define PROJECT_OSU_TIMING_WHEEL_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace osu {
+
+    // Link embedded in whatever a TimingWheel schedules, recover the owner with OSU_CONTAINER_OF.
+    struct TimingWheelNode {
+        TimingWheelNode *prev = nullptr;
+        TimingWheelNode *next = nullptr;
+        // Absolute tick the node is due at.
+        uint64_t expiry = 0;
+        // level * slots + slot while linked.
+        uint32_t slot = 0;
+
+        bool linked() const {
+            return next != nullptr;
+        }
+    };
+
+    // Hierarchical timing wheel, levels of 64 slots, each level 64 times coarser than the one below.
+    // insert and remove are O(1); a node drops one level each time its slot comes round, so it is
+    // moved at most levels-1 times before it fires. Ticks are whatever unit the owner picks.
+    // Not thread safe, it belongs to the thread that advances it.
+    class TimingWheel {
+    public:
+        static const unsigned slot_bits = 6;
+        static const unsigned slots = 1u << slot_bits;
+        static const unsigned levels = 6;
+        // Expiries further out than this are parked in the top level and re-filed when it comes round.
+        static const uint64_t range = 1ull << (slot_bits * levels);
+        static const uint64_t never = UINT64_MAX;
+
+        explicit TimingWheel(uint64_t now = 0) : now_(now), size_(0) {
+            for (unsigned i = 0; i < levels * slots; ++i) {
+                heads_[i].prev = heads_[i].next = &heads_[i];
+            }
+            for (unsigned l = 0; l < levels; ++l) {
+                occupied_[l] = 0;
+            }
+        }
+
+        TimingWheel(TimingWheel const &) = delete;
+
+        TimingWheel &operator=(TimingWheel const &) = delete;
+
+        // Ticks up to and including now() have been processed.
+        uint64_t now() const {
+            return now_;
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+        bool empty() const {
+            return size_ == 0;
+        }
+
+        // node->expiry must be set. Anything already due fires on the next advance().
+        void insert(TimingWheelNode *node) {
+            assert(!node->linked());
+            place(node, node->expiry > now_ ? node->expiry : now_ + 1);
+            size_++;
+        }
+
+        // node must be linked; removing one that is not is a bug caught by the assert, a no-op under NDEBUG.
+        void remove(TimingWheelNode *node) {
+            assert(node->linked());
+            if (!node->linked()) {
+                return;
+            }
+            unlink(node);
+            size_--;
+        }
+
+        // Earliest tick at which advance() has something to do, never when empty. This is a lower
+        // bound for the next expiry: a coarse slot coming round may only move nodes down a level.
+        uint64_t next_event() const {
+            uint64_t next = never;
+            for (unsigned l = 0; l < levels; ++l) {
+                if (occupied_[l] == 0) continue;
+
+                unsigned shift = l * slot_bits;
+                uint64_t base = now_ >> shift;
+                unsigned current = (unsigned) (base & (slots - 1));
+                // Slots are visited from the one after current; current itself comes round last.
+                unsigned rot = (current + 1) & (slots - 1);
+                uint64_t bits = rot == 0 ? occupied_[l] : (occupied_[l] >> rot) | (occupied_[l] << (slots - rot));
+                uint64_t when = (base + __builtin_ctzll(bits) + 1) << shift;
+                if (when < next) next = when;
+            }
+            return next;
+        }
+
+        // Processes every tick up to to, calling expired(node) for each due node in expiry order.
+        // The node is already unlinked, the callback may insert or remove nodes.
+        template<typename F>
+        void advance(uint64_t to, F &&expired) {
+            while (true) {
+                uint64_t t = next_event();
+                if (t > to) {
+                    if (to > now_) now_ = to;
+                    return;
+                }
+
+                now_ = t;
+                for (unsigned l = 1; l < levels && (t & ((1ull << (l * slot_bits)) - 1)) == 0; ++l) {
+                    cascade(l, (unsigned) ((t >> (l * slot_bits)) & (slots - 1)));
+                }
+
+                TimingWheelNode *head = &heads_[t & (slots - 1)];
+                while (head->next != head) {
+                    TimingWheelNode *node = head->next;
+                    remove(node);
+                    expired(node);
+                }
+            }
+        }
+
+        // Unlinks every node, calling release(node) for each.
+        template<typename F>
+        void clear(F &&release) {
+            for (unsigned i = 0; i < levels * slots; ++i) {
+                TimingWheelNode *head = &heads_[i];
+                while (head->next != head) {
+                    TimingWheelNode *node = head->next;
+                    remove(node);
+                    release(node);
+                }
+            }
+        }
+
+    private:
+        void place(TimingWheelNode *node, uint64_t expiry) {
+            uint64_t delta = expiry - now_;
+            if (delta >= range) {
+                delta = range - 1;
+                expiry = now_ + delta;
+            }
+
+            unsigned level = 0;
+            while (delta >= (1ull << ((level + 1) * slot_bits))) {
+                level++;
+            }
+
+            unsigned slot = (unsigned) ((expiry >> (level * slot_bits)) & (slots - 1));
+            TimingWheelNode *head = &heads_[level * slots + slot];
+            node->slot = level * slots + slot;
+            node->prev = head->prev;
+            node->next = head;
+            head->prev->next = node;
+            head->prev = node;
+            occupied_[level] |= 1ull << slot;
+        }
+
+        void unlink(TimingWheelNode *node) {
+            node->prev->next = node->next;
+            node->next->prev = node->prev;
+            TimingWheelNode *head = &heads_[node->slot];
+            if (head->next == head) {
+                occupied_[node->slot / slots] &= ~(1ull << (node->slot % slots));
+            }
+            node->prev = node->next = nullptr;
+        }
+
+        // Re-files a coarse slot that came round one level down (or further).
+        void cascade(unsigned level, unsigned slot) {
+            TimingWheelNode *head = &heads_[level * slots + slot];
+            while (head->next != head) {
+                TimingWheelNode *node = head->next;
+                unlink(node);
+                place(node, node->expiry > now_ ? node->expiry : now_);
+            }
+        }
+
+        TimingWheelNode heads_[levels * slots];
+        uint64_t occupied_[levels];
+        uint64_t now_;
+        size_t size_;
+    };
+}
+
+#endif //PROJECT_OSU_TIMING_WHEEL_H